@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2011-2013 Colin Jones
+ * Copyright (C) 2014-2023 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * replays a recorded trace of /proc/apm through the update code of cbatticon
+ * as fast as possible, and reports the ticks per second and the allocations per tick
+ *
+ * a trace has one sample per line, the seconds since the start of the recording
+ * followed by the contents of /proc/apm, as recorded by:
+ *   while sleep 5; do echo "$(date +%s) $(cat /proc/apm)"; done
+ */
+
+/* the clock comes from the trace, and there is no widget to draw */
+#define g_get_monotonic_time      bench_get_monotonic_time
+#define gtk_image_set_from_pixbuf bench_image_set_from_pixbuf
+#define main                      cbatticon_main
+
+#include "../cbatticon.c"
+
+#undef main
+
+#define BENCH_DEFAULT_TICKS 1000000
+
+struct trace_sample {
+    gint64              seconds;
+    struct battery_info info;
+};
+
+static struct trace_sample *trace_samples = NULL;
+static guint                trace_length  = 0;
+static gint64               trace_period  = 0;
+
+static guint64 bench_tick  = 0;
+static guint64 allocations = 0;
+
+/*
+ * every allocation of the process goes through these (glibc only)
+ */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *malloc (size_t size)
+{
+    allocations++;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc (ptr, size);
+}
+
+/*
+ * replay backend functions
+ */
+
+static gboolean replay_backend_open (void)
+{
+    return trace_length > 0;
+}
+
+static gboolean replay_backend_read (struct battery_info *info)
+{
+    *info = trace_samples[bench_tick % trace_length].info;
+
+    return TRUE;
+}
+
+static gint replay_backend_open_events (void)
+{
+    return -1;
+}
+
+static gboolean replay_backend_read_events (gint fd)
+{
+    return TRUE;
+}
+
+static void replay_backend_close (void)
+{
+}
+
+static const struct battery_backend replay_backend = {
+    "replay", replay_backend_open, replay_backend_read, replay_backend_open_events, replay_backend_read_events, replay_backend_close
+};
+
+gint64 bench_get_monotonic_time (void)
+{
+    /* the trace is looped over, so its time has to keep going forward */
+
+    gint64 seconds = trace_samples[bench_tick % trace_length].seconds + (gint64)(bench_tick / trace_length) * trace_period;
+
+    return seconds * G_USEC_PER_SEC;
+}
+
+void bench_image_set_from_pixbuf (GtkImage *image, GdkPixbuf *pixbuf)
+{
+}
+
+static gboolean load_trace (const gchar *path)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gchar **lines;
+    guint i;
+
+    if (g_file_get_contents (path, &contents, NULL, &error) == FALSE) {
+        g_printerr ("Cannot read trace: %s\n", error->message);
+        g_error_free (error); error = NULL;
+
+        return FALSE;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    trace_samples = g_new0 (struct trace_sample, g_strv_length (lines));
+
+    for (i = 0; lines[i] != NULL; i++) {
+        struct trace_sample *sample = &trace_samples[trace_length];
+        long long seconds;
+        int offset = 0;
+
+        if (lines[i][0] == '\0' || lines[i][0] == '#') {
+            continue;
+        }
+
+        /* the samples go through the parser of the apm backend */
+
+        if (sscanf (lines[i], "%lld %n", &seconds, &offset) != 1 || parse_apm_info (lines[i] + offset, &sample->info) == FALSE) {
+            g_printerr ("%s:%u: invalid sample\n", path, i + 1);
+            continue;
+        }
+
+        sample->seconds = seconds;
+
+        trace_length++;
+    }
+
+    g_strfreev (lines);
+
+    if (trace_length == 0) {
+        g_printerr ("%s: no samples\n", path);
+
+        return FALSE;
+    }
+
+    /* the loop restarts one sampling interval after the last sample */
+
+    trace_period = trace_samples[trace_length - 1].seconds - trace_samples[0].seconds;
+
+    if (trace_length > 1) {
+        trace_period += trace_period / (trace_length - 1);
+    }
+
+    trace_period = MAX (trace_period, 1);
+
+    return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+    /* a docked tray icon without widgets, so that the tooltip and icon diffing run */
+    struct icon tray_icon;
+    struct battery_state state;
+
+    guint64 ticks = BENCH_DEFAULT_TICKS;
+    guint64 start_allocations;
+    GTimer *timer;
+    gdouble elapsed;
+
+    if (argc < 2) {
+        g_printerr ("Usage: %s TRACE [TICKS]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc > 2) {
+        ticks = g_ascii_strtoull (argv[2], NULL, 10);
+    }
+
+    if (ticks == 0 || load_trace (argv[1]) == FALSE || replay_backend.open () == FALSE) {
+        return 1;
+    }
+
+    init_tray_icon (&tray_icon);
+    battery_backend = &replay_backend;
+    load_string_templates ();
+
+    configuration.headless            = TRUE;
+    configuration.icon_type           = BATTERY_ICON_STANDARD;
+    configuration.min_update_interval = configuration.update_interval;
+    configuration.max_update_interval = configuration.fallback_interval;
+#ifdef WITH_NOTIFY
+    configuration.hide_notification = TRUE;
+#endif
+
+    timer = g_timer_new ();
+    start_allocations = allocations;
+
+    for (bench_tick = 0; bench_tick < ticks; bench_tick++) {
+        update_tray_icon_status (&tray_icon, &state);
+        get_update_interval (&state);
+    }
+
+    elapsed = g_timer_elapsed (timer, NULL);
+
+    g_printf ("%s: %" G_GUINT64_FORMAT " ticks in %.3f s, %.0f ticks/s, %.3f allocations/tick, %u updates suppressed\n",
+              argv[1], ticks, elapsed, ticks / MAX (elapsed, 1e-9),
+              (gdouble)(allocations - start_allocations) / ticks, suppressed_updates);
+
+    g_timer_destroy (timer);
+    g_free (trace_samples);
+
+    return 0;
+}
@@ -25,22 +25,36 @@
 #define CBATTICON_VERSION_STRING "1.6.13"
 #define CBATTICON_STRING         "cbatticon-apm"
 
+/*
+ * for readlink () and pread (), for sigemptyset () and PIPE_BUF, and for clock_gettime ()
+ * and CLOCK_BOOTTIME, defined before glib pulls in the system headers
+ */
+#define _POSIX_C_SOURCE 200809L
+
 #include <glib.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #ifdef WITH_NOTIFY
 #include <libnotify/notify.h>
 #endif
 
-/* for readlink() */
-#define __USE_XOPEN_EXTENDED
-
 #include <apm.h>
 #include "eggtrayicon.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libintl.h>
+#include <limits.h>
+#include <linux/netlink.h>
 #include <locale.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #if 0
@@ -56,26 +70,71 @@
 /* replaces gprintf.h */
 #include <stdio.h>
 #define g_printf printf
-#define g_sprintf sprintf
 
 #include <string.h>
 #define g_strcmp0 strcmp
 
 #endif
 
-#define DEFAULT_UPDATE_INTERVAL 5
+#ifndef PIXMAPDIR
+#define PIXMAPDIR "/usr/share/pixmaps/cbatticon"
+#endif
+
+#define DEFAULT_UPDATE_INTERVAL   5
+#define DEFAULT_FALLBACK_INTERVAL 60
+#define DEFAULT_MIN_UPDATE_INTERVAL(INTERVAL) MAX ((INTERVAL) / 5, 1)
+#define DEFAULT_MAX_UPDATE_INTERVAL(INTERVAL) ((INTERVAL) * 6)
 #define DEFAULT_LOW_LEVEL       20
 #define DEFAULT_CRITICAL_LEVEL  5
+#define DEFAULT_LEVEL_HYSTERESIS 2
+
+#define DEFAULT_NOTIFICATION_DEBOUNCE 1000
 
 #define STR_LTH 256
 
+#define SYSFS_POWER_SUPPLY_PATH "/sys/class/power_supply"
+
+#define MAX_BATTERIES 4
+
+#define HISTORY_MAGIC          0x31484243 /* "CBH1" */
+#define HISTORY_SAMPLES        8192
+#define HISTORY_SYNC_SAMPLES   32
+#define HISTORY_WARM_START_AGE 600
+
+#define STATUS_MAGIC 0x31534243 /* "CBS1" */
+
+#define TRACE_MAGIC  0x31544243 /* "CBT1" */
+#define TRACE_EVENTS 1024
+
+#define DEBUG_BUFFER_SIZE    8192
+#define PENDING_SYSLOG_COUNT 8
+
+#define THRESHOLD_TIMER_SLACK 2 /* seconds */
+#define SUSPEND_SLACK         1 /* seconds between the boottime and monotonic clocks taken for a suspend */
+
+#define DEFAULT_ICON_SIZE 24
+#define TOOLTIP_DELAY     500   /* milliseconds of hovering before the tooltip of a direct draw icon shows up */
+#define ICONS_CACHE_SIZE  64    /* a full icons table at three sizes, for screens with different trays */
+
+#define COMMAND_LOW_LEVEL_DELAY      5
+#define COMMAND_CRITICAL_LEVEL_DELAY 30
+
 enum {
     UNKNOWN_ICON = 0,
     BATTERY_ICON_STANDARD,
     BATTERY_ICON_NOTIFICATION,
-    BATTERY_ICON_GPM
+    BATTERY_ICON_GPM,
+    BATTERY_ICON_RENDERED
 };
 
+/* a build can fix the icon type (see MINIMAL in the Makefile), the branches of the other ones
+   then fold away at compile time, along with their icon names */
+#ifdef FIXED_ICON_TYPE
+#define ICON_TYPE FIXED_ICON_TYPE
+#else
+#define ICON_TYPE configuration.icon_type
+#endif
+
 enum {
     MISSING = 0,
     UNKNOWN,
@@ -87,537 +146,3938 @@ enum {
     CRITICAL_LEVEL
 };
 
+/*
+ * icons are resolved once at startup for the selected icon type,
+ * indexed by state and by level (up to 20, 40, 60, 80 and 100 percent)
+ */
+
+enum {
+    ICON_STATE_DISCHARGING = 0,
+    ICON_STATE_CHARGING,
+    ICON_STATE_CHARGED,
+    ICON_STATE_MISSING,
+    ICON_STATES
+};
+
+#define ICON_LEVELS 5
+
+#define ICON_ID(STATE,LEVEL) ((STATE) * ICON_LEVELS + (LEVEL))
+#define ICON_IDS             (ICON_STATES * ICON_LEVELS)
+
 struct configuration {
     gboolean display_version;
     gboolean debug_output;
+    gboolean headless;
+    gboolean profile;
     gint     update_interval;
+    gint     min_update_interval;
+    gint     max_update_interval;
+    gint     fallback_interval;
     gint     icon_type;
     gint     low_level;
     gint     critical_level;
+    gint     level_hysteresis;
     gchar   *command_low_level;
     gchar   *command_critical_level;
     gchar   *command_left_click;
+    gchar   *icon_directory;
+    gchar   *history_file;
+    gchar   *status_file;
+    gchar   *backend;
+    gchar   *config_file;
+    gboolean icon_percentage;
+    gboolean direct_draw;
+    gchar   *trace_file;
 #ifdef WITH_NOTIFY
     gboolean hide_notification;
+    gint     notification_debounce;
 #endif
     gboolean list_icon_types;
 } configuration = {
+    FALSE,
+    FALSE,
     FALSE,
     FALSE,
     DEFAULT_UPDATE_INTERVAL,
+    0,
+    0,
+    DEFAULT_FALLBACK_INTERVAL,
     UNKNOWN_ICON,
     DEFAULT_LOW_LEVEL,
     DEFAULT_CRITICAL_LEVEL,
+    DEFAULT_LEVEL_HYSTERESIS,
+    NULL,
+    NULL,
+    NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
+    NULL,
+    FALSE,
+    FALSE,
+    NULL,
 #ifdef WITH_NOTIFY
     FALSE,
+    DEFAULT_NOTIFICATION_DEBOUNCE,
 #endif
-    FALSE,
     FALSE
 };
 
+/* the options as given on the command line, before validation, that a reload starts from */
+static struct configuration command_line_configuration;
+static gchar *command_line_icon_type = NULL;
+
+struct rendered_state {
+    gint  status;
+    gint  percentage;
+    gint  time;
+    gint  icon_id;
+    guint batteries;
+    gint  battery_status[MAX_BATTERIES];
+    gint  battery_percentage[MAX_BATTERIES];
+};
+
+/*
+ * one tray icon per screen, in a list fed from a single battery sample,
+ * each holding references from the icons cache at the size of its own tray
+ */
+
 struct icon {
     EggTrayIcon *egg_tray_icon;
     GtkWidget *image;
     GtkTooltips *tooltips;
-    gchar *name;
     gint size;
+    struct rendered_state rendered;
+    gchar tooltip[STR_LTH];     /* the text last handed to gtk, empty before the first update */
+    GdkPixbuf *icons[ICON_IDS];
+    struct icon *next;
+    GtkWidget *tooltip_window;  /* direct draw only, created on the first hover */
+    GtkWidget *tooltip_label;
+    guint tooltip_source_id;
+};
+
+enum {
+    BATTERY_STATE_LOW_LEVEL      = 1 << 0,
+    BATTERY_STATE_CRITICAL_LEVEL = 1 << 1
+};
+
+/*
+ * a sample of all the batteries, as read by the backend in a single pass,
+ * and their aggregate: the percentage is weighted by the capacity of each battery
+ */
+
+struct battery_info {
+    gint    status;                             /* MISSING, UNKNOWN, CHARGED, CHARGING, DISCHARGING or NOTCHARGING */
+    gint    percentage;
+    gint    ac_line_status;                     /* 0 off-line, 1 on-line, 0xff unknown (as in apm) */
+    guint   batteries;
+    gint    battery_status[MAX_BATTERIES];
+    gint    battery_percentage[MAX_BATTERIES];
+    gint    battery_time[MAX_BATTERIES];        /* remaining time in minutes, -1 if unknown */
+    gdouble battery_capacity[MAX_BATTERIES];    /* full capacity, in any unit shared by the batteries */
+};
+
+/*
+ * the battery backends keep their files open, and read them with pread() on each update,
+ * they can also provide a file descriptor that becomes readable when the battery changes
+ */
+
+struct battery_backend {
+    const gchar *name;
+    gboolean   (*open) (void);
+    gboolean   (*read) (struct battery_info *info);
+    gint       (*open_events) (void);            /* -1 if the backend cannot tell */
+    gboolean   (*read_events) (gint fd);         /* TRUE if the battery may have changed */
+    void       (*close) (void);
+};
+
+struct battery_state {
+    gint    status;
+    gint    percentage;
+    gint    time;
+    gdouble rate;        /* in percent per second, negative when discharging */
+    guint   flags;
+};
+
+/*
+ * workaround for limited/bugged batteries/drivers that don't provide current rate
+ * the rate is fitted with least squares over the last capacity changes, for each battery
+ */
+
+#define ESTIMATION_SAMPLES 16
+
+struct estimation_sample {
+    gdouble seconds;
+    gdouble remaining_capacity;
+};
+
+struct estimation {
+    struct estimation_sample samples[ESTIMATION_SAMPLES];
+    guint                    head;
+    guint                    count;
+    gdouble                  rate;
+    gint                     status;    /* of the battery when the samples were taken */
 };
 
-GHashTable *icons_cache;
+static struct estimation estimations[MAX_BATTERIES];
+
+static struct icon *tray_icons = NULL;    /* NULL in headless mode */
 
 static gint get_options (int argc, char **argv);
+static void validate_configuration (const gchar *icon_type_string);
 static void print_usage ();
 
-static gboolean get_battery_status (apm_info *info, gint *status);
-
-static gboolean get_battery_charge (apm_info *info, gboolean remaining, gint *percentage, gint *time);
-static gboolean get_battery_time_estimation (gdouble remaining_capacity, gdouble y, gint *time);
+static gboolean load_config_file (const gchar *path, struct configuration *config, gchar **icon_type_string);
+static void free_config_file_strings (struct configuration *config, const struct configuration *base);
+static void reload_configuration (void);
+static gboolean on_reload_signal (gpointer user_data);
+
+static void profile_phase (gint phase);
+static void profile_tick (gint tick, gint64 start);
+static void profile_round_trip (gint64 microseconds);
+static gboolean on_profile_signal (gpointer user_data);
+static gboolean on_quit_signal (gpointer user_data);
+static void dump_profile (void);
+
+static void trace_event (gint type, gint a, gint b);
+static void trace_suppressed_updates (void);
+static gboolean dump_trace (const gchar *path);
+static gboolean on_trace_signal (gpointer user_data);
+static void debug_printf (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
+static void trace_syslog (gint priority, const gchar *format, ...) G_GNUC_PRINTF (2, 3);
+static void schedule_log_flush (void);
+static gboolean on_log_flush (gpointer user_data);
+static void flush_logs (void);
+static void print_error (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
+
+static gboolean open_battery_backend (const gchar *name);
+static void close_battery_backend (void);
+static gboolean read_battery_info (struct battery_info *info);
+
+static gboolean parse_apm_info (const gchar *buffer, struct battery_info *info);
+static gboolean apm_backend_open (void);
+static gboolean apm_backend_read (struct battery_info *info);
+static gint apm_backend_open_events (void);
+static gboolean apm_backend_read_events (gint fd);
+static void apm_backend_close (void);
+
+static gboolean sysfs_backend_open (void);
+static gboolean sysfs_backend_read (struct battery_info *info);
+static gint sysfs_backend_open_events (void);
+static gboolean sysfs_backend_read_events (gint fd);
+static void sysfs_backend_close (void);
+
+static gboolean get_battery_charge (struct battery_info *info, gboolean remaining, gint *percentage, gint *time, gdouble *rate);
+static gboolean get_battery_time_estimation (struct estimation *estimation, gdouble remaining_capacity, gdouble y, gint *time);
+static void add_battery_time_estimation_sample (struct estimation *estimation, gdouble seconds, gdouble remaining_capacity);
 static void reset_battery_time_estimation (void);
-
-static void create_tray_icon (void);
-static void set_tray_icon (struct icon *tray_icon, const gchar *name);
+static void forget_battery_time_estimation_samples (void);
+static gint64 get_suspended_time (void);
+
+static gboolean open_history (const gchar *path);
+static void record_history_sample (struct battery_info *info, const struct battery_state *state);
+static void load_history_estimation_samples (gint status);
+
+static gboolean open_status_export (const gchar *path);
+static void publish_status (const struct battery_state *state);
+
+static gboolean open_battery_events (struct icon *tray_icon);
+static gboolean on_battery_events (GIOChannel *source, GIOCondition condition, struct icon *tray_icon);
+
+static struct icon *create_tray_icons (void);
+static struct icon *create_tray_icon (GdkScreen *screen);
+static void init_tray_icon (struct icon *tray_icon);
+static void load_tray_icons (struct icon *tray_icon);
+static void reload_tray_icons (struct icon *tray_icon);
+static void set_tray_icon (struct icon *tray_icon, gint icon_id);
+static void set_tray_icon_tooltip (struct icon *tray_icon, const struct battery_info *info, gint state, gint percentage, gint time, gchar *tip_text);
+static void set_tray_icons (struct icon *tray_icons, const struct battery_info *info, gint state, gint percentage, gint time, gint icon_id);
+static void on_tray_icon_size_allocate (GtkWidget *widget, GtkAllocation *allocation, struct icon *tray_icon);
+static void on_tray_icon_embedded (GtkPlug *plug, struct icon *tray_icon);
+static GdkPixbuf *get_tray_icon_pixbuf (struct icon *tray_icon, gint icon_id);
+static gboolean on_tray_icon_expose (GtkWidget *widget, GdkEventExpose *event, struct icon *tray_icon);
+static gboolean on_tray_icon_enter (GtkWidget *widget, GdkEventCrossing *event, struct icon *tray_icon);
+static gboolean on_tray_icon_leave (GtkWidget *widget, GdkEventCrossing *event, struct icon *tray_icon);
+static gboolean on_tooltip_timeout (struct icon *tray_icon);
+static void show_tooltip_window (struct icon *tray_icon);
 static gboolean update_tray_icon (struct icon *tray_icon);
-static void update_tray_icon_status (struct icon *tray_icon);
+static gboolean schedule_tray_icon_update (struct icon *tray_icon, const struct battery_state *state);
+static guint add_update_timeout (gint interval, struct icon *tray_icon);
+static gboolean on_update_timer (GIOChannel *source, GIOCondition condition, struct icon *tray_icon);
+static void schedule_threshold_update (struct icon *tray_icon, const struct battery_state *state);
+static gboolean on_threshold_timeout (struct icon *tray_icon);
+static gint get_next_threshold (const struct battery_state *state);
+static gint get_update_interval (const struct battery_state *state);
+static void update_tray_icon_status (struct icon *tray_icon, struct battery_state *state);
 static gboolean on_tray_icon_click (struct icon *tray_icon, GdkEventButton *event, gpointer user_data);
 
 #ifdef WITH_NOTIFY
-static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency);
+/*
+ * a notification popup, with its last message waiting for the end of the debounce window
+ */
+
+struct notification {
+    NotifyNotification *notification;
+    gchar               summary[STR_LTH];
+    gchar               body[STR_LTH];
+    gboolean            has_body;
+    gint                timeout;
+    NotifyUrgency       urgency;
+    guint               source_id;      /* of the pending message, 0 if none */
+};
+
+static void notify_message (struct notification *notification, const gchar *summary, const gchar *body, gint timeout, NotifyUrgency urgency);
+static gboolean show_notification (gpointer data);
 #define NOTIFY_MESSAGE(...) notify_message(__VA_ARGS__)
 #else
 #define NOTIFY_MESSAGE(...)
 #endif
 
-static gchar* get_tooltip_string (gchar *battery, gchar *time);
+static void start_spawn_helper (void);
+static void run_spawn_helper (gint request_fd, gint reply_fd);
+static gboolean on_spawn_reply (GIOChannel *source, GIOCondition condition, gpointer user_data);
+static void prepare_spawn_commands (void);
+static gboolean prepare_spawn_command (gint index, GError **error);
+static void run_spawn_command (gint index);
+static void report_spawn_error (gint index, const gchar *message);
+
+static void schedule_deferred_command (gint index);
+static void cancel_deferred_commands (void);
+static void reschedule_cancelled_commands (gint percentage);
+static gboolean run_deferred_command (gpointer data);
+
+static void load_string_templates (void);
+static gsize format_tooltip (gchar *buffer, gsize size, const struct rendered_state *rendered);
+static gsize format_battery (gchar *buffer, gsize size, gint state, gint percentage);
+static gsize format_time (gchar *buffer, gsize size, gint minutes);
 static gchar* get_battery_string (gint state, gint percentage);
 static gchar* get_time_string (gint minutes);
 static gchar* get_icon_name (gint state, gint percentage);
+static gint get_icon_id (gint state, gint percentage);
+static GdkPixbuf *get_rendered_icon (gint rendered_id, gint size);
+static void prune_rendered_icons (gint size);
+static const gchar *get_icon_directory (void);
 static char *get_icon_path (const gchar *name);
-
-/*
- * workaround for limited/bugged batteries/drivers that don't provide current rate
- * the next 4 variables are used to calculate estimated time
- */
-
-static gdouble  estimation_remaining_capacity = -1;
-static gint     estimation_time               = -1;
-static GTimer  *estimation_timer              = NULL;
+static void probe_icon_types (void);
+static GdkPixbuf *load_icon (const gchar *name, gint size, GError **error);
+static GdkPixbuf *get_cached_icon (const gchar *name, gint size, GError **error);
 
 #define ICON_PATH_MAX_LEN 256
 
-static char *get_icon_path (const gchar *name)
+static const gchar *get_icon_directory (void)
 {
-    static char path[ICON_PATH_MAX_LEN];
-    ssize_t link_length = readlink("/proc/self/exe", path, ICON_PATH_MAX_LEN - 1);
-    g_assert (link_length > 0);
-    path[link_length] = 0;
+    static gchar *icon_directory = NULL;
+    char path[ICON_PATH_MAX_LEN];
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("executable path is \"%s\"\n", path);
+    if (icon_directory != NULL) {
+        return icon_directory;
     }
 
-    char *prefix_offset = strstr(path, "/bin/");
+    if (configuration.icon_directory != NULL) {
+        icon_directory = configuration.icon_directory;
+    } else {
+        /* look for the icons next to the executable, as in <prefix>/bin/cbatticon */
+
+        ssize_t link_length = readlink ("/proc/self/exe", path, ICON_PATH_MAX_LEN - 1);
+        char *prefix_offset = NULL;
+
+        /* a path that does not fit is not looked at, rather than truncated */
+
+        if (link_length > 0 && link_length < ICON_PATH_MAX_LEN - 1) {
+            path[link_length] = 0;
+
+            if (configuration.debug_output == TRUE) {
+                debug_printf ("executable path is \"%s\"\n", path);
+            }
+
+            prefix_offset = strstr (path, "/bin/");
+        }
+
+        if (prefix_offset != NULL) {
+            *prefix_offset = '\0';
+            icon_directory = g_strdup_printf ("%s/share/pixmaps/cbatticon", path);
+        } else {
+            icon_directory = g_strdup (PIXMAPDIR);
+        }
+    }
 
-    if (prefix_offset == NULL) {
-        strcpy(path, "/usr");
-        prefix_offset = &path[4];
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("icon directory is \"%s\"\n", icon_directory);
     }
 
-    g_assert ((prefix_offset - path) + 25 + strlen(name) + 4 + 1 < ICON_PATH_MAX_LEN);
-    g_sprintf (prefix_offset, "/share/pixmaps/cbatticon/%s.png", name);
+    return icon_directory;
+}
+
+static char *get_icon_path (const gchar *name)
+{
+    /* kept until the next call, an --icon-dir of any length is not truncated */
+    static gchar *path = NULL;
+    gchar file_name[STR_LTH];
+
+    g_snprintf (file_name, STR_LTH, "%s.png", name);
+
+    g_free (path);
+    path = g_build_filename (get_icon_directory (), file_name, NULL);
 
     if (configuration.debug_output == TRUE) {
-        g_printf ("icon path is \"%s\"\n", path);
+        debug_printf ("icon path is \"%s\"\n", path);
     }
 
-    return path; /* this is Not Very Good but it should be good enough here */
+    return path;
 }
 
 /*
- * command line options function
+ * icons built into the executable (see EMBED_ICONS in the Makefile)
  */
 
-static gint get_options (int argc, char **argv)
-{
-    /*GError *error = NULL;*/
+#ifdef WITH_EMBEDDED_ICONS
+struct embedded_icon {
+    const gchar  *name;
+    const guint8 *data;
+};
 
-    gchar *icon_type_string = NULL;
+#include "icons.h"
 
-    /*GOptionEntry option_entries[] = {
-        { "version"               , 'v', 0, G_OPTION_ARG_NONE  , &configuration.display_version       , N_("Display the version")                                      , NULL },
-        { "debug"                 , 'd', 0, G_OPTION_ARG_NONE  , &configuration.debug_output          , N_("Display debug information")                                , NULL },
-        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &configuration.update_interval       , N_("Set update interval (in seconds)")                         , NULL },
-        { "icon-type"             , 'i', 0, G_OPTION_ARG_STRING, &icon_type_string                    , N_("Set icon type ('standard', 'notification' or 'symbolic')") , NULL },
-        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &configuration.low_level             , N_("Set low battery level (in percent)")                       , NULL },
-        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &configuration.critical_level        , N_("Set critical battery level (in percent)")                  , NULL },
-        { "command-low-level"     , 'o', 0, G_OPTION_ARG_STRING, &configuration.command_low_level     , N_("Command to execute when low battery level is reached")     , NULL },
-        { "command-critical-level", 'c', 0, G_OPTION_ARG_STRING, &configuration.command_critical_level, N_("Command to execute when critical battery level is reached"), NULL },
-        { "command-left-click"    , 'x', 0, G_OPTION_ARG_STRING, &configuration.command_left_click    , N_("Command to execute when left clicking on tray icon")       , NULL },
-#ifdef WITH_NOTIFY
-        { "hide-notification"     , 'n', 0, G_OPTION_ARG_NONE  , &configuration.hide_notification     , N_("Hide the notification popups")                             , NULL },
+/* an explicit icon directory takes precedence over the embedded icons */
+#define USE_EMBEDDED_ICONS (configuration.icon_directory == NULL)
+#else
+#define USE_EMBEDDED_ICONS FALSE
 #endif
-        { "list-icon-types"       , 't', 0, G_OPTION_ARG_NONE  , &configuration.list_icon_types       , N_("List available icon types")                                , NULL },
-        { NULL }
-    };*/
 
-    static struct option long_options[] = {
-        { "help",                   no_argument, NULL, 'h' },
-        { "version",                no_argument, NULL, 'v' },
-        { "debug",                  no_argument, NULL, 'd' },
-        { "update-interval",        no_argument, NULL, 'u' },
-        { "icon-type",              no_argument, NULL, 'i' },
-        { "low-level",              no_argument, NULL, 'l' },
-        { "critical-level",         no_argument, NULL, 'r' },
-        { "command-low-level",      no_argument, NULL, 'o' },
-        { "command-critical-level", no_argument, NULL, 'c' },
-        { "command-left-click",     no_argument, NULL, 'x' },
-#ifdef WITH_NOTIFY
-        { "hide-notification",      no_argument, NULL, 'n' },
-#endif
-        { "list-icon-types",        no_argument, NULL, 't' },
-        { NULL }
-    };
+static GdkPixbuf *load_icon (const gchar *name, gint size, GError **error)
+{
+#ifdef WITH_EMBEDDED_ICONS
+    const struct embedded_icon *embedded_icon;
 
-    /*option_context = g_option_context_new (_("[BATTERY ID]"));
-    g_option_context_add_main_entries (option_context, option_entries, CBATTICON_STRING);
+    if (USE_EMBEDDED_ICONS) {
+        for (embedded_icon = embedded_icons; embedded_icon->name != NULL; embedded_icon++) {
+            if (g_strcmp0 (embedded_icon->name, name) == 0) {
+                GdkPixbuf *pixbuf = gdk_pixbuf_new_from_inline (-1, embedded_icon->data, FALSE, error);
+                GdkPixbuf *scaled_pixbuf;
 
-    if (g_option_context_parse (option_context, &argc, &argv, &error) == FALSE) {
-        g_printerr (_("Cannot parse command line arguments: %s\n"), error->message);
-        g_error_free (error); error = NULL;
+                if (pixbuf == NULL || (gdk_pixbuf_get_width (pixbuf) == size && gdk_pixbuf_get_height (pixbuf) == size)) {
+                    return pixbuf;
+                }
 
-        return -1;
+                scaled_pixbuf = gdk_pixbuf_scale_simple (pixbuf, size, size, GDK_INTERP_BILINEAR);
+                g_object_unref (pixbuf);
+
+                return scaled_pixbuf;
+            }
+        }
     }
+#endif
 
-    g_option_context_free (option_context);*/
+    return gdk_pixbuf_new_from_file_at_size (get_icon_path (name), size, size, error);
+}
 
-    while (1) {
-        int option_index = 0;
+/*
+ * bounded cache of the decoded icons, keyed by icon name and size,
+ * the most recently used entries being kept at the head of the queue
+ */
 
-        int c = getopt_long (argc, argv,
-                         "hvdu:i:l:r:o:c:x:"
-#ifdef WITH_NOTIFY
-                         "n"
-#endif
-                         "t",
-                         long_options, &option_index);
+struct cached_icon {
+    GQuark     name;
+    gint       size;
+    GdkPixbuf *pixbuf;
+};
 
-        if (c == -1)
-            break;
+static GQueue icons_cache           = G_QUEUE_INIT;
+static guint  icons_cache_hits      = 0;
+static guint  icons_cache_misses    = 0;
+static guint  icons_cache_evictions = 0;
 
-        if (c == 0) {
-            c = long_options[option_index].val;
-        }
+static GdkPixbuf *get_cached_icon (const gchar *name, gint size, GError **error)
+{
+    GQuark quark = g_quark_from_string (name);
+    struct cached_icon *cached_icon;
+    GList *link;
 
-        switch (c) {
-            case 'h':
-                print_usage ();
-                exit (0);
-            case 'v':
-                configuration.display_version = TRUE;
-                break;
-            case 'd':
-                configuration.debug_output = TRUE;
-                break;
-#ifdef WITH_NOTIFY
-            case 'n':
-                configuration.hide_notification = TRUE;
-                break;
-#endif
-            case 't':
-                configuration.list_icon_types = TRUE;
-                break;
-            case 'u':
-                configuration.update_interval = strtol (optarg, NULL, 10);
-                break;
-            case 'i':
-                icon_type_string = g_strdup (optarg);
-                break;
-            case 'l':
-                configuration.low_level = strtol (optarg, NULL, 10);
-                break;
-            case 'r':
-                configuration.critical_level = strtol (optarg, NULL, 10);
-                break;
-            case 'o':
-                configuration.command_low_level = g_strdup (optarg);
-                break;
-            case 'c':
-                configuration.command_critical_level = g_strdup (optarg);
-                break;
-            case 'x':
-                configuration.command_left_click = g_strdup (optarg);
-                break;
-            default:
-                abort ();
-        }
-    }
+    for (link = icons_cache.head; link != NULL; link = link->next) {
+        cached_icon = link->data;
 
-    /* option : display the version */
+        if (cached_icon->name == quark && cached_icon->size == size) {
+            icons_cache_hits++;
 
-    if (configuration.display_version == TRUE) {
-        g_print (_("cbatticon: a lightweight and fast battery icon that sits in your system tray\n"));
-        g_print (_("version %s\n"), CBATTICON_VERSION_STRING);
+            g_queue_unlink (&icons_cache, link);
+            g_queue_push_head_link (&icons_cache, link);
 
-        return 0;
+            return g_object_ref (cached_icon->pixbuf);
+        }
     }
 
-    /* option : list available icon types */
+    icons_cache_misses++;
 
-    gtk_init (&argc, &argv); /* gtk is required as from this point */
+    GdkPixbuf *pixbuf = load_icon (name, size, error);
 
-    #define HAS_STANDARD_ICON_TYPE      (access (get_icon_path ("battery-full"), F_OK) == 0)
-    #define HAS_NOTIFICATION_ICON_TYPE  (access (get_icon_path ("notification-battery-100"), F_OK) == 0)
-    #define HAS_GPM_ICON_TYPE           (access (get_icon_path ("gpm-primary-100"), F_OK) == 0)
+    if (pixbuf == NULL) {
+        return NULL;
+    }
 
-    if (configuration.list_icon_types == TRUE) {
-        g_print (_("List of available icon types:\n"));
-        g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
-        g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
-        g_print ("gpm\t\t%s\n"       , HAS_GPM_ICON_TYPE          == TRUE ? _("available") : _("unavailable"));
+    if (icons_cache.length >= ICONS_CACHE_SIZE) {
+        cached_icon = g_queue_pop_tail (&icons_cache);
+        icons_cache_evictions++;
 
-        return 0;
+        /* the icons table may still hold a reference to it */
+        g_object_unref (cached_icon->pixbuf);
+        g_slice_free (struct cached_icon, cached_icon);
     }
 
-    /* option : set icon type */
+    cached_icon = g_slice_new (struct cached_icon);
+    cached_icon->name   = quark;
+    cached_icon->size   = size;
+    cached_icon->pixbuf = pixbuf;
 
-    if (icon_type_string != NULL) {
-        if (g_strcmp0 (icon_type_string, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_STANDARD;
-        else if (g_strcmp0 (icon_type_string, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (g_strcmp0 (icon_type_string, "gpm") == 0 && HAS_GPM_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_GPM;
-        else g_printerr (_("Unknown icon type: %s\n"), icon_type_string);
+    g_queue_push_head (&icons_cache, cached_icon);
 
-        g_free (icon_type_string);
-    }
+    return g_object_ref (pixbuf);
+}
 
-    if (configuration.icon_type == UNKNOWN_ICON) {
-        if (HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_STANDARD;
-        else if (HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (HAS_GPM_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_GPM;
-        else g_printerr (_("No icon type found!\n"));
-    }
+/*
+ * available icon types, found with a single scan of the icon directory
+ * (or of the embedded icons)
+ */
 
-    /* option : update interval */
+static gint available_icon_types = 0;
 
-    if (configuration.update_interval <= 0) {
-        configuration.update_interval = DEFAULT_UPDATE_INTERVAL;
-        g_printerr (_("Invalid update interval! It has been reset to default (%d seconds)\n"), DEFAULT_UPDATE_INTERVAL);
-    }
+#define HAS_ICON_TYPE(TYPE)         ((available_icon_types & (1 << (TYPE))) != 0)
+#define HAS_STANDARD_ICON_TYPE      HAS_ICON_TYPE (BATTERY_ICON_STANDARD)
+#define HAS_NOTIFICATION_ICON_TYPE  HAS_ICON_TYPE (BATTERY_ICON_NOTIFICATION)
+#define HAS_GPM_ICON_TYPE           HAS_ICON_TYPE (BATTERY_ICON_GPM)
+#define HAS_RENDERED_ICON_TYPE      HAS_ICON_TYPE (BATTERY_ICON_RENDERED)
 
-    /* option : low and critical levels */
+#ifdef FIXED_ICON_TYPE
+static const gchar *icon_type_names[] = { NULL, "standard", "notification", "gpm", "rendered" };
+#endif
 
-    if (configuration.low_level < 0 || configuration.low_level > 100) {
-        configuration.low_level = DEFAULT_LOW_LEVEL;
-        g_printerr (_("Invalid low level! It has been reset to default (%d percent)\n"), DEFAULT_LOW_LEVEL);
-    }
+static void probe_icon_name (const gchar *name, gsize length)
+{
+    static const struct {
+        gint         icon_type;
+        const gchar *name;
+    } probes[] = {
+        { BATTERY_ICON_STANDARD    , "battery-full"             },
+        { BATTERY_ICON_NOTIFICATION, "notification-battery-100" },
+        { BATTERY_ICON_GPM         , "gpm-primary-100"          }
+    };
+    guint i;
 
-    if (configuration.critical_level < 0 || configuration.critical_level > 100) {
-        configuration.critical_level = DEFAULT_CRITICAL_LEVEL;
-        g_printerr (_("Invalid critical level! It has been reset to default (%d percent)\n"), DEFAULT_CRITICAL_LEVEL);
+    for (i = 0; i < G_N_ELEMENTS (probes); i++) {
+        if (strlen (probes[i].name) == length && strncmp (probes[i].name, name, length) == 0) {
+            available_icon_types |= 1 << probes[i].icon_type;
+        }
+    }
+}
+
+static void probe_icon_types (void)
+{
+    const gchar *file_name;
+    GDir *directory;
+
+    /* drawn with cairo, there are no files to look for */
+    available_icon_types |= 1 << BATTERY_ICON_RENDERED;
+
+#ifdef WITH_EMBEDDED_ICONS
+    const struct embedded_icon *embedded_icon;
+
+    if (USE_EMBEDDED_ICONS) {
+        for (embedded_icon = embedded_icons; embedded_icon->name != NULL; embedded_icon++) {
+            probe_icon_name (embedded_icon->name, strlen (embedded_icon->name));
+        }
+
+        return;
+    }
+#endif
+
+    directory = g_dir_open (get_icon_directory (), 0, NULL);
+
+    if (directory == NULL) {
+        return;
+    }
+
+    while ((file_name = g_dir_read_name (directory)) != NULL) {
+        gsize length = strlen (file_name);
+
+        if (length > 4 && g_strcmp0 (file_name + length - 4, ".png") == 0) {
+            probe_icon_name (file_name, length - 4);
+        }
+    }
+
+    g_dir_close (directory);
+}
+
+/*
+ * profiling functions
+ */
+
+/*
+ * startup phases are timed from the start of main (),
+ * per tick operations are gathered in power of two histograms (in microseconds)
+ */
+
+enum {
+    PROFILE_PHASE_OPTIONS = 0,
+    PROFILE_PHASE_GTK_INIT,
+    PROFILE_PHASE_ICON_PROBE,
+    PROFILE_PHASE_ICON_LOAD,
+    PROFILE_PHASE_FIRST_READ,
+    PROFILE_PHASE_FIRST_DOCK,
+    PROFILE_PHASES
+};
+
+enum {
+    PROFILE_TICK_READ = 0,
+    PROFILE_TICK_FORMAT,
+    PROFILE_TICK_ICON,
+    PROFILE_TICK_TOOLTIP,
+    PROFILE_TICK_ROUND_TRIP,
+    PROFILE_TICK_RENDER,
+    PROFILE_TICKS
+};
+
+#define PROFILE_BUCKETS 24 /* the last bucket gathers everything above 2^22 microseconds */
+
+#define PROFILE_NOW() (configuration.profile == TRUE ? g_get_monotonic_time () : 0)
+
+struct profile_histogram {
+    guint  count;
+    gint64 total;
+    gint64 max;
+    guint  buckets[PROFILE_BUCKETS];
+};
+
+static const gchar *profile_phase_names[PROFILE_PHASES] = {
+    "options", "gtk_init", "icon probing", "icon loading", "first battery read", "first dock"
+};
+
+static const gchar *profile_tick_names[PROFILE_TICKS] = {
+    "battery read", "string formatting", "set_tray_icon", "set_tooltip_text", "X round trip", "icon rendering"
+};
+
+static gint64                   profile_start = 0;
+static gint64                   profile_phases[PROFILE_PHASES];
+static struct profile_histogram profile_ticks[PROFILE_TICKS];
+
+static GMainLoop *main_loop = NULL;
+
+static void profile_phase (gint phase)
+{
+    /* only the first occurrence of a phase is recorded */
+
+    if (configuration.profile == FALSE || profile_phases[phase] != 0) {
+        return;
+    }
+
+    profile_phases[phase] = MAX (g_get_monotonic_time () - profile_start, 1);
+}
+
+static void profile_add (struct profile_histogram *histogram, gint64 microseconds)
+{
+    guint bucket = 0;
+
+    while (bucket < PROFILE_BUCKETS - 1 && (microseconds >> bucket) > 0) {
+        bucket++;
+    }
+
+    histogram->count++;
+    histogram->total += microseconds;
+    histogram->max    = MAX (histogram->max, microseconds);
+    histogram->buckets[bucket]++;
+}
+
+static void profile_tick (gint tick, gint64 start)
+{
+    if (configuration.profile == FALSE) {
+        return;
+    }
+
+    profile_add (&profile_ticks[tick], g_get_monotonic_time () - start);
+}
+
+static void profile_round_trip (gint64 microseconds)
+{
+    profile_add (&profile_ticks[PROFILE_TICK_ROUND_TRIP], microseconds);
+}
+
+static gboolean on_profile_signal (gpointer user_data)
+{
+    dump_profile ();
+
+    return TRUE;
+}
+
+static gboolean on_quit_signal (gpointer user_data)
+{
+    if (main_loop != NULL) {
+        g_main_loop_quit (main_loop);
+    } else {
+        gtk_main_quit ();
+    }
+
+    return TRUE;
+}
+
+static void dump_profile (void)
+{
+    gint phase, tick;
+    guint bucket;
+
+    /* after the debug output queued so far */
+    flush_logs ();
+
+    g_printf ("startup phases (since start of main):\n");
+
+    for (phase = 0; phase < PROFILE_PHASES; phase++) {
+        if (profile_phases[phase] == 0) {
+            g_printf ("  %-20s not reached\n", profile_phase_names[phase]);
+        } else {
+            g_printf ("  %-20s %" G_GINT64_FORMAT " us\n", profile_phase_names[phase], profile_phases[phase]);
+        }
+    }
+
+    g_printf ("per tick operations:\n");
+
+    for (tick = 0; tick < PROFILE_TICKS; tick++) {
+        struct profile_histogram *histogram = &profile_ticks[tick];
+
+        if (histogram->count == 0) {
+            g_printf ("  %-20s no samples\n", profile_tick_names[tick]);
+            continue;
+        }
+
+        g_printf ("  %-20s %u samples, mean %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n",
+                  profile_tick_names[tick], histogram->count, histogram->total / histogram->count, histogram->max);
+
+        for (bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+            if (histogram->buckets[bucket] == 0) {
+                continue;
+            }
+
+            if (bucket == PROFILE_BUCKETS - 1) {
+                g_printf ("    >= %8u us: %u\n", 1U << (bucket - 1), histogram->buckets[bucket]);
+            } else {
+                g_printf ("    <  %8u us: %u\n", 1U << bucket, histogram->buckets[bucket]);
+            }
+        }
+    }
+
+    fflush (stdout);
+}
+
+/*
+ * trace functions
+ *
+ * the update path records its events (status changes, level crossings, spawns, suppressed
+ * updates) into a ring in memory, dumped to the trace file on SIGUSR2, and queues its debug
+ * output and syslog messages, written in batches from an idle source: no system call per tick
+ */
+
+enum {
+    TRACE_EVENT_STATUS = 0,     /* a: status, b: percentage */
+    TRACE_EVENT_LEVEL,          /* a: LOW_LEVEL or CRITICAL_LEVEL, b: percentage */
+    TRACE_EVENT_DEFERRED,       /* a: spawn command index, b: 1 if scheduled, 0 if skipped */
+    TRACE_EVENT_SPAWN,          /* a: spawn command index, b: 1 through the helper, 0 directly */
+    TRACE_EVENT_SPAWN_ERROR,    /* a: spawn command index */
+    TRACE_EVENT_SUPPRESSED,     /* b: updates suppressed since the previous change, recorded with the change */
+    TRACE_EVENT_RESUME          /* b: seconds of suspend */
+};
+
+struct trace_header {
+    guint32 magic;
+    guint32 capacity;
+    guint32 head;
+    guint32 count;
+};
+
+struct trace_event {
+    gint64  time;               /* microseconds since the epoch */
+    guint16 type;
+    gint16  a;
+    gint32  b;
+};
+
+struct pending_syslog {
+    gint  priority;
+    gchar message[STR_LTH];
+};
+
+static struct trace_event trace_events[TRACE_EVENTS];
+static guint              trace_head  = 0;
+static guint              trace_count = 0;
+
+static gchar debug_buffer[DEBUG_BUFFER_SIZE];
+static gsize debug_length = 0;
+
+static struct pending_syslog pending_syslogs[PENDING_SYSLOG_COUNT];
+static guint                 pending_syslog_count = 0;
+
+static guint log_flush_source_id = 0;
+
+static void trace_event (gint type, gint a, gint b)
+{
+    struct trace_event *event;
+
+    if (configuration.trace_file == NULL) {
+        return;
+    }
+
+    event = &trace_events[trace_head];
+    event->time = g_get_real_time ();
+    event->type = type;
+    event->a    = a;
+    event->b    = b;
+
+    trace_head  = (trace_head + 1) % TRACE_EVENTS;
+    trace_count = MIN (trace_count + 1, TRACE_EVENTS);
+}
+
+static gboolean dump_trace (const gchar *path)
+{
+    struct trace_header header = { TRACE_MAGIC, TRACE_EVENTS, 0, trace_count };
+    gsize size = sizeof (header) + trace_count * sizeof (struct trace_event);
+    gchar *contents = g_malloc (size);
+    guint first = (trace_head + TRACE_EVENTS - trace_count) % TRACE_EVENTS;
+    GError *error = NULL;
+    gboolean ret;
+    guint i;
+
+    /* the oldest event first, the head of the dump being its end */
+
+    header.head = trace_count % TRACE_EVENTS;
+    memcpy (contents, &header, sizeof (header));
+
+    for (i = 0; i < trace_count; i++) {
+        memcpy (contents + sizeof (header) + i * sizeof (struct trace_event), &trace_events[(first + i) % TRACE_EVENTS], sizeof (struct trace_event));
+    }
+
+    ret = g_file_set_contents (path, contents, size, &error);
+    g_free (contents);
+
+    if (ret == FALSE) {
+        print_error (_("Cannot write trace file: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+    } else if (configuration.debug_output == TRUE) {
+        debug_printf ("trace: %u events dumped to %s\n", trace_count, path);
+    }
+
+    return ret;
+}
+
+static gboolean on_trace_signal (gpointer user_data)
+{
+    /* the ongoing run of suppressed updates is part of the dump */
+    trace_suppressed_updates ();
+
+    dump_trace (configuration.trace_file);
+
+    return TRUE;
+}
+
+static void debug_printf (const gchar *format, ...)
+{
+    va_list args;
+    gint length;
+
+    va_start (args, format);
+    length = g_vsnprintf (debug_buffer + debug_length, DEBUG_BUFFER_SIZE - debug_length, format, args);
+    va_end (args);
+
+    /* a full buffer is written at once, the line being formatted again */
+
+    if (length >= 0 && debug_length + length >= DEBUG_BUFFER_SIZE) {
+        debug_buffer[debug_length] = '\0';
+        flush_logs ();
+
+        va_start (args, format);
+        length = g_vsnprintf (debug_buffer, DEBUG_BUFFER_SIZE, format, args);
+        va_end (args);
+    }
+
+    if (length > 0) {
+        debug_length = MIN (debug_length + length, DEBUG_BUFFER_SIZE - 1);
+    }
+
+    schedule_log_flush ();
+}
+
+static void trace_syslog (gint priority, const gchar *format, ...)
+{
+    struct pending_syslog *pending;
+    va_list args;
+
+    if (pending_syslog_count == PENDING_SYSLOG_COUNT) {
+        flush_logs ();
+    }
+
+    pending = &pending_syslogs[pending_syslog_count++];
+    pending->priority = priority;
+
+    va_start (args, format);
+    g_vsnprintf (pending->message, STR_LTH, format, args);
+    va_end (args);
+
+    schedule_log_flush ();
+}
+
+static void schedule_log_flush (void)
+{
+    if (log_flush_source_id == 0) {
+        log_flush_source_id = g_idle_add_full (G_PRIORITY_LOW, on_log_flush, NULL, NULL);
+    }
+}
+
+static gboolean on_log_flush (gpointer user_data)
+{
+    log_flush_source_id = 0;
+
+    flush_logs ();
+
+    return FALSE;
+}
+
+static void flush_logs (void)
+{
+    guint i;
+
+    for (i = 0; i < pending_syslog_count; i++) {
+        syslog (pending_syslogs[i].priority, "%s", pending_syslogs[i].message);
+    }
+
+    pending_syslog_count = 0;
+
+    if (debug_length > 0) {
+        fwrite (debug_buffer, 1, debug_length, stdout);
+        fflush (stdout);
+        debug_length = 0;
+    }
+}
+
+/* an error comes out after the debug output queued before it */
+
+static void print_error (const gchar *format, ...)
+{
+    va_list args;
+    gchar *message;
+
+    va_start (args, format);
+    message = g_strdup_vprintf (format, args);
+    va_end (args);
+
+    flush_logs ();
+    g_printerr ("%s", message);
+
+    g_free (message);
+}
+
+/*
+ * rendered icon functions
+ *
+ * a battery body filled up to the exact percentage, drawn with cairo:
+ * the theme icons have no common interior to fill, so the whole battery is drawn,
+ * and each frame is cached by size, state, level and percentage, to be drawn at most once
+ */
+
+enum {
+    RENDERED_LEVEL_NORMAL = 0,
+    RENDERED_LEVEL_LOW,
+    RENDERED_LEVEL_CRITICAL,
+    RENDERED_LEVELS
+};
+
+#define RENDERED_PERCENTAGES 101
+#define RENDERED_ICON_ID(STATE,LEVEL,PERCENTAGE) ((((STATE) * RENDERED_LEVELS) + (LEVEL)) * RENDERED_PERCENTAGES + CLAMP ((PERCENTAGE), 0, 100))
+#define RENDERED_ICON_IDS RENDERED_ICON_ID (ICON_STATES, 0, 0)
+#define RENDERED_ICON_KEY(SIZE,ID) GINT_TO_POINTER ((SIZE) * RENDERED_ICON_IDS + (ID))
+
+static GHashTable *rendered_icons = NULL;    /* rendered id and size to pixbuf */
+static guint rendered_icons_drawn = 0;
+
+static gint get_rendered_icon_level (gint state, gint percentage)
+{
+    /* the levels only color a discharging battery, the frames follow a change of the levels */
+
+    if (state != DISCHARGING && state != NOTCHARGING) {
+        return RENDERED_LEVEL_NORMAL;
+    }
+
+    if (percentage <= configuration.critical_level) {
+        return RENDERED_LEVEL_CRITICAL;
+    }
+
+    if (percentage <= configuration.low_level) {
+        return RENDERED_LEVEL_LOW;
+    }
+
+    return RENDERED_LEVEL_NORMAL;
+}
+
+static GdkPixbuf *get_pixbuf_from_surface (cairo_surface_t *surface, gint size)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, size, size);
+    guchar *pixels = gdk_pixbuf_get_pixels (pixbuf);
+    gint rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+    guchar *data = cairo_image_surface_get_data (surface);
+    gint stride = cairo_image_surface_get_stride (surface);
+    gint x, y;
+
+    /* cairo has native endian premultiplied argb, gdk-pixbuf has straight rgba */
+
+    cairo_surface_flush (surface);
+
+    for (y = 0; y < size; y++) {
+        const guint32 *source = (const guint32 *)(data + y * stride);
+        guchar *destination = pixels + y * rowstride;
+
+        for (x = 0; x < size; x++, destination += 4) {
+            guint32 argb = source[x];
+            guint alpha = argb >> 24;
+
+            destination[3] = alpha;
+
+            if (alpha == 0) {
+                destination[0] = destination[1] = destination[2] = 0;
+                continue;
+            }
+
+            destination[0] = (((argb >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+            destination[1] = (((argb >>  8) & 0xff) * 255 + alpha / 2) / alpha;
+            destination[2] = (( argb        & 0xff) * 255 + alpha / 2) / alpha;
+        }
+    }
+
+    return pixbuf;
+}
+
+static GdkPixbuf *draw_rendered_icon (gint icon_state, gint level, gint percentage, gint size)
+{
+    cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, size, size);
+    cairo_t *cr = cairo_create (surface);
+    gdouble line = MAX (size / 16.0, 1);
+    gdouble nub = MAX (size / 12.0, 1);
+    gdouble x = line / 2, y = size / 4.0 + line / 2;
+    gdouble width = size - nub - line, height = size / 2.0 - line;
+    GdkPixbuf *pixbuf;
+
+    /* the body, its nub and its fill */
+
+    cairo_rectangle (cr, x, y, width, height);
+    cairo_set_source_rgba (cr, 1, 1, 1, 0.6);
+    cairo_fill_preserve (cr);
+    cairo_set_source_rgb (cr, 0.2, 0.2, 0.2);
+    cairo_set_line_width (cr, line);
+    cairo_stroke (cr);
+
+    cairo_rectangle (cr, x + width + line / 2, size / 2.0 - height / 4, nub, height / 2);
+    cairo_fill (cr);
+
+    if (icon_state == ICON_STATE_MISSING) {
+        cairo_move_to (cr, x + width * 0.25, y + height * 0.85);
+        cairo_line_to (cr, x + width * 0.75, y + height * 0.15);
+        cairo_set_source_rgb (cr, 0.8, 0, 0);
+        cairo_stroke (cr);
+    } else {
+        if (level == RENDERED_LEVEL_CRITICAL) {
+            cairo_set_source_rgb (cr, 0.8, 0, 0);
+        } else if (level == RENDERED_LEVEL_LOW) {
+            cairo_set_source_rgb (cr, 0.96, 0.47, 0);
+        } else {
+            cairo_set_source_rgb (cr, 0.3, 0.6, 0.2);
+        }
+
+        cairo_rectangle (cr, x + line, y + line, (width - 2 * line) * percentage / 100.0, height - 2 * line);
+        cairo_fill (cr);
+    }
+
+    /* a bolt when charging, or the percentage */
+
+    if (icon_state == ICON_STATE_CHARGING && configuration.icon_percentage == FALSE) {
+        cairo_move_to (cr, x + width * 0.55, y + line);
+        cairo_line_to (cr, x + width * 0.30, y + height * 0.55);
+        cairo_line_to (cr, x + width * 0.50, y + height * 0.55);
+        cairo_line_to (cr, x + width * 0.45, y + height - line);
+        cairo_line_to (cr, x + width * 0.70, y + height * 0.45);
+        cairo_line_to (cr, x + width * 0.50, y + height * 0.45);
+        cairo_close_path (cr);
+        cairo_set_source_rgb (cr, 1, 0.85, 0);
+        cairo_fill_preserve (cr);
+        cairo_set_source_rgb (cr, 0.2, 0.2, 0.2);
+        cairo_set_line_width (cr, line / 2);
+        cairo_stroke (cr);
+    }
+
+    if (configuration.icon_percentage == TRUE && icon_state != ICON_STATE_MISSING) {
+        cairo_text_extents_t extents;
+        gchar text[4];
+
+        g_snprintf (text, sizeof (text), "%d", percentage);
+
+        cairo_select_font_face (cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+        cairo_set_font_size (cr, height * 0.9);
+        cairo_text_extents (cr, text, &extents);
+
+        cairo_move_to (cr, x + (width - extents.width) / 2 - extents.x_bearing, y + (height - extents.height) / 2 - extents.y_bearing);
+        cairo_text_path (cr, text);
+        cairo_set_source_rgb (cr, 1, 1, 1);
+        cairo_set_line_width (cr, line * 1.5);
+        cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+        cairo_stroke_preserve (cr);
+        cairo_set_source_rgb (cr, 0, 0, 0);
+        cairo_fill (cr);
+    }
+
+    cairo_destroy (cr);
+
+    pixbuf = get_pixbuf_from_surface (surface, size);
+    cairo_surface_destroy (surface);
+
+    return pixbuf;
+}
+
+static gboolean is_rendered_icon_size (gpointer key, gpointer value, gpointer size)
+{
+    return GPOINTER_TO_INT (key) / RENDERED_ICON_IDS == GPOINTER_TO_INT (size);
+}
+
+static void prune_rendered_icons (gint size)
+{
+    struct icon *tray_icon;
+    guint pruned;
+
+    /* the frames of a size that no tray icon has any longer */
+
+    if (rendered_icons == NULL) {
+        return;
+    }
+
+    for (tray_icon = tray_icons; tray_icon != NULL; tray_icon = tray_icon->next) {
+        if (tray_icon->size == size) {
+            return;
+        }
+    }
+
+    pruned = g_hash_table_foreach_remove (rendered_icons, is_rendered_icon_size, GINT_TO_POINTER (size));
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("rendered icons: %u frames of %d pixels pruned\n", pruned, size);
+    }
+}
+
+static GdkPixbuf *get_rendered_icon (gint rendered_id, gint size)
+{
+    gpointer key = RENDERED_ICON_KEY (size, rendered_id);
+    GdkPixbuf *pixbuf;
+
+    if (rendered_icons == NULL) {
+        rendered_icons = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_object_unref);
+    }
+
+    pixbuf = g_hash_table_lookup (rendered_icons, key);
+
+    if (pixbuf == NULL) {
+        gint percentage = rendered_id % RENDERED_PERCENTAGES;
+        gint level      = rendered_id / RENDERED_PERCENTAGES % RENDERED_LEVELS;
+        gint icon_state = rendered_id / RENDERED_PERCENTAGES / RENDERED_LEVELS;
+        gint64 start    = PROFILE_NOW ();
+
+        pixbuf = draw_rendered_icon (icon_state, level, percentage, size);
+        g_hash_table_insert (rendered_icons, key, pixbuf);
+
+        profile_tick (PROFILE_TICK_RENDER, start);
+        rendered_icons_drawn++;
+
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("rendered icon: state %d, level %d, %d%%, %d pixels (%u drawn)\n", icon_state, level, percentage, size, rendered_icons_drawn);
+        }
+    }
+
+    return pixbuf;
+}
+
+/*
+ * command line options function
+ */
+
+static gint get_options (int argc, char **argv)
+{
+    /*GError *error = NULL;*/
+
+    gchar *icon_type_string = NULL;
+
+    /*GOptionEntry option_entries[] = {
+        { "version"               , 'v', 0, G_OPTION_ARG_NONE  , &configuration.display_version       , N_("Display the version")                                      , NULL },
+        { "debug"                 , 'd', 0, G_OPTION_ARG_NONE  , &configuration.debug_output          , N_("Display debug information")                                , NULL },
+        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &configuration.update_interval       , N_("Set update interval (in seconds)")                         , NULL },
+        { "icon-type"             , 'i', 0, G_OPTION_ARG_STRING, &icon_type_string                    , N_("Set icon type ('standard', 'notification' or 'symbolic')") , NULL },
+        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &configuration.low_level             , N_("Set low battery level (in percent)")                       , NULL },
+        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &configuration.critical_level        , N_("Set critical battery level (in percent)")                  , NULL },
+        { "command-low-level"     , 'o', 0, G_OPTION_ARG_STRING, &configuration.command_low_level     , N_("Command to execute when low battery level is reached")     , NULL },
+        { "command-critical-level", 'c', 0, G_OPTION_ARG_STRING, &configuration.command_critical_level, N_("Command to execute when critical battery level is reached"), NULL },
+        { "command-left-click"    , 'x', 0, G_OPTION_ARG_STRING, &configuration.command_left_click    , N_("Command to execute when left clicking on tray icon")       , NULL },
+#ifdef WITH_NOTIFY
+        { "hide-notification"     , 'n', 0, G_OPTION_ARG_NONE  , &configuration.hide_notification     , N_("Hide the notification popups")                             , NULL },
+#endif
+        { "list-icon-types"       , 't', 0, G_OPTION_ARG_NONE  , &configuration.list_icon_types       , N_("List available icon types")                                , NULL },
+        { NULL }
+    };*/
+
+    static struct option long_options[] = {
+        { "help",                   no_argument, NULL, 'h' },
+        { "version",                no_argument, NULL, 'v' },
+        { "debug",                  no_argument, NULL, 'd' },
+        { "headless",               no_argument, NULL, 'b' },
+        { "profile",                no_argument, NULL, 'P' },
+        { "update-interval",        required_argument, NULL, 'u' },
+        { "min-update-interval",    required_argument, NULL, 'm' },
+        { "max-update-interval",    required_argument, NULL, 'M' },
+        { "fallback-interval",      required_argument, NULL, 'f' },
+        { "icon-type",              required_argument, NULL, 'i' },
+        { "low-level",              required_argument, NULL, 'l' },
+        { "critical-level",         required_argument, NULL, 'r' },
+        { "level-hysteresis",       required_argument, NULL, 'y' },
+        { "command-low-level",      required_argument, NULL, 'o' },
+        { "command-critical-level", required_argument, NULL, 'c' },
+        { "command-left-click",     required_argument, NULL, 'x' },
+        { "icon-dir",               required_argument, NULL, 'I' },
+        { "history-file",           required_argument, NULL, 'H' },
+        { "status-file",            required_argument, NULL, 'S' },
+        { "backend",                required_argument, NULL, 'B' },
+        { "config-file",            required_argument, NULL, 'C' },
+        { "icon-percentage",        no_argument, NULL, 'R' },
+        { "direct-draw",            no_argument, NULL, 'D' },
+        { "trace-file",             required_argument, NULL, 'T' },
+#ifdef WITH_NOTIFY
+        { "hide-notification",      no_argument, NULL, 'n' },
+        { "notification-debounce",  required_argument, NULL, 'N' },
+#endif
+        { "list-icon-types",        no_argument, NULL, 't' },
+        { NULL }
+    };
+
+    /*option_context = g_option_context_new (_("[BATTERY ID]"));
+    g_option_context_add_main_entries (option_context, option_entries, CBATTICON_STRING);
+
+    if (g_option_context_parse (option_context, &argc, &argv, &error) == FALSE) {
+        print_error (_("Cannot parse command line arguments: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+
+        return -1;
+    }
+
+    g_option_context_free (option_context);*/
+
+    while (1) {
+        int option_index = 0;
+
+        int c = getopt_long (argc, argv,
+                         "hvdbPu:m:M:f:i:l:r:y:o:c:x:I:H:S:B:C:RDT:"
+#ifdef WITH_NOTIFY
+                         "nN:"
+#endif
+                         "t",
+                         long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        if (c == 0) {
+            c = long_options[option_index].val;
+        }
+
+        switch (c) {
+            case 'h':
+                print_usage ();
+                exit (0);
+            case 'v':
+                configuration.display_version = TRUE;
+                break;
+            case 'd':
+                configuration.debug_output = TRUE;
+                break;
+            case 'b':
+                configuration.headless = TRUE;
+                break;
+            case 'P':
+                configuration.profile = TRUE;
+                break;
+#ifdef WITH_NOTIFY
+            case 'n':
+                configuration.hide_notification = TRUE;
+                break;
+            case 'N':
+                configuration.notification_debounce = strtol (optarg, NULL, 10);
+                break;
+#endif
+            case 't':
+                configuration.list_icon_types = TRUE;
+                break;
+            case 'u':
+                configuration.update_interval = strtol (optarg, NULL, 10);
+                break;
+            case 'm':
+                configuration.min_update_interval = strtol (optarg, NULL, 10);
+                break;
+            case 'M':
+                configuration.max_update_interval = strtol (optarg, NULL, 10);
+                break;
+            case 'f':
+                configuration.fallback_interval = strtol (optarg, NULL, 10);
+                break;
+            case 'i':
+                icon_type_string = g_strdup (optarg);
+                break;
+            case 'l':
+                configuration.low_level = strtol (optarg, NULL, 10);
+                break;
+            case 'r':
+                configuration.critical_level = strtol (optarg, NULL, 10);
+                break;
+            case 'y':
+                configuration.level_hysteresis = strtol (optarg, NULL, 10);
+                break;
+            case 'o':
+                configuration.command_low_level = g_strdup (optarg);
+                break;
+            case 'c':
+                configuration.command_critical_level = g_strdup (optarg);
+                break;
+            case 'x':
+                configuration.command_left_click = g_strdup (optarg);
+                break;
+            case 'I':
+                configuration.icon_directory = g_strdup (optarg);
+                break;
+            case 'H':
+                configuration.history_file = g_strdup (optarg);
+                break;
+            case 'S':
+                configuration.status_file = g_strdup (optarg);
+                break;
+            case 'B':
+                configuration.backend = g_strdup (optarg);
+                break;
+            case 'C':
+                configuration.config_file = g_strdup (optarg);
+                break;
+            case 'R':
+                configuration.icon_percentage = TRUE;
+                break;
+            case 'D':
+                configuration.direct_draw = TRUE;
+                break;
+            case 'T':
+                configuration.trace_file = g_strdup (optarg);
+                break;
+            default:
+                abort ();
+        }
+    }
+
+    profile_phase (PROFILE_PHASE_OPTIONS);
+
+    /* option : display the version */
+
+    if (configuration.display_version == TRUE) {
+        g_print (_("cbatticon: a lightweight and fast battery icon that sits in your system tray\n"));
+        g_print (_("version %s\n"), CBATTICON_VERSION_STRING);
+
+        return 0;
+    }
+
+    /* option : list available icon types, there are none to look for without tray icon otherwise */
+
+    if (configuration.headless == FALSE || configuration.list_icon_types == TRUE) {
+        probe_icon_types ();
+    }
+
+    profile_phase (PROFILE_PHASE_ICON_PROBE);
+
+    if (configuration.list_icon_types == TRUE) {
+        g_print (_("List of available icon types:\n"));
+#ifdef FIXED_ICON_TYPE
+        g_print ("%s\t%s\n", icon_type_names[FIXED_ICON_TYPE], HAS_ICON_TYPE (FIXED_ICON_TYPE) == TRUE ? _("available") : _("unavailable"));
+#else
+        g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+        g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
+        g_print ("gpm\t\t%s\n"       , HAS_GPM_ICON_TYPE          == TRUE ? _("available") : _("unavailable"));
+        g_print ("rendered\t%s\n"    , HAS_RENDERED_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+#endif
+
+        return 0;
+    }
+
+    /* option : configuration file, read over the command line, and again on SIGHUP */
+
+    command_line_configuration = configuration;
+    command_line_icon_type     = g_strdup (icon_type_string);
+
+    if (configuration.config_file != NULL) {
+        load_config_file (configuration.config_file, &configuration, &icon_type_string);
+    }
+
+    validate_configuration (icon_type_string);
+    g_free (icon_type_string);
+
+#ifdef FIXED_ICON_TYPE
+    /* there is no other icon type to fall back to */
+
+    if (configuration.headless == FALSE && HAS_ICON_TYPE (FIXED_ICON_TYPE) == FALSE) {
+        return -1;
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * the same rules apply to the command line, to the configuration file and to its reloads
+ */
+
+static void validate_configuration (const gchar *icon_type_string)
+{
+    /* option : set icon type */
+
+#ifdef FIXED_ICON_TYPE
+    configuration.icon_type = FIXED_ICON_TYPE;
+
+    if (icon_type_string != NULL) {
+        print_error (_("The icon type is fixed in this build, ignoring: %s\n"), icon_type_string);
+    }
+
+    if (HAS_ICON_TYPE (FIXED_ICON_TYPE) == FALSE && configuration.headless == FALSE) {
+        print_error (_("The icons of the %s icon type of this build are not available in %s!\n"), icon_type_names[FIXED_ICON_TYPE], get_icon_directory ());
+    }
+#else
+    if (icon_type_string != NULL && configuration.headless == FALSE) {
+        if (g_strcmp0 (icon_type_string, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_STANDARD;
+        else if (g_strcmp0 (icon_type_string, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
+        else if (g_strcmp0 (icon_type_string, "gpm") == 0 && HAS_GPM_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_GPM;
+        else if (g_strcmp0 (icon_type_string, "rendered") == 0 && HAS_RENDERED_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_RENDERED;
+        else print_error (_("Unknown icon type: %s\n"), icon_type_string);
+    }
+
+    if (configuration.icon_type == UNKNOWN_ICON) {
+        if (HAS_STANDARD_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_STANDARD;
+        else if (HAS_NOTIFICATION_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
+        else if (HAS_GPM_ICON_TYPE == TRUE)
+            configuration.icon_type = BATTERY_ICON_GPM;
+        else if (configuration.headless == FALSE) {
+            /* a missing theme is reported, the rendered icons are only used when asked for */
+            print_error (_("No icon type found!\n"));
+            print_error (_("No icons in %s, the rendered icons can be selected with --icon-type rendered\n"), get_icon_directory ());
+        }
+    }
+#endif
+
+    /* option : update interval */
+
+    if (configuration.update_interval <= 0) {
+        configuration.update_interval = DEFAULT_UPDATE_INTERVAL;
+        print_error (_("Invalid update interval! It has been reset to default (%d seconds)\n"), DEFAULT_UPDATE_INTERVAL);
+    }
+
+    if (configuration.min_update_interval <= 0 || configuration.min_update_interval > configuration.update_interval) {
+        if (configuration.min_update_interval != 0) {
+            print_error (_("Invalid minimum update interval! It has been reset to default (%d seconds)\n"), DEFAULT_MIN_UPDATE_INTERVAL (configuration.update_interval));
+        }
+
+        configuration.min_update_interval = DEFAULT_MIN_UPDATE_INTERVAL (configuration.update_interval);
+    }
+
+    if (configuration.max_update_interval <= 0 || configuration.max_update_interval < configuration.update_interval) {
+        if (configuration.max_update_interval != 0) {
+            print_error (_("Invalid maximum update interval! It has been reset to default (%d seconds)\n"), DEFAULT_MAX_UPDATE_INTERVAL (configuration.update_interval));
+        }
+
+        configuration.max_update_interval = DEFAULT_MAX_UPDATE_INTERVAL (configuration.update_interval);
+    }
+
+    if (configuration.fallback_interval <= 0) {
+        configuration.fallback_interval = DEFAULT_FALLBACK_INTERVAL;
+        print_error (_("Invalid fallback interval! It has been reset to default (%d seconds)\n"), DEFAULT_FALLBACK_INTERVAL);
+    }
+
+    configuration.fallback_interval = MAX (configuration.fallback_interval, configuration.max_update_interval);
+
+    /* option : low and critical levels */
+
+    if (configuration.low_level < 0 || configuration.low_level > 100) {
+        configuration.low_level = DEFAULT_LOW_LEVEL;
+        print_error (_("Invalid low level! It has been reset to default (%d percent)\n"), DEFAULT_LOW_LEVEL);
+    }
+
+    if (configuration.critical_level < 0 || configuration.critical_level > 100) {
+        configuration.critical_level = DEFAULT_CRITICAL_LEVEL;
+        print_error (_("Invalid critical level! It has been reset to default (%d percent)\n"), DEFAULT_CRITICAL_LEVEL);
     }
 
     if (configuration.critical_level > configuration.low_level) {
         configuration.critical_level = DEFAULT_CRITICAL_LEVEL;
         configuration.low_level = DEFAULT_LOW_LEVEL;
-        g_printerr (_("Critical level is higher than low level! They have been reset to default\n"));
+        print_error (_("Critical level is higher than low level! They have been reset to default\n"));
+    }
+
+    if (configuration.level_hysteresis < 0 || configuration.level_hysteresis > 100) {
+        configuration.level_hysteresis = DEFAULT_LEVEL_HYSTERESIS;
+        print_error (_("Invalid level hysteresis! It has been reset to default (%d percent)\n"), DEFAULT_LEVEL_HYSTERESIS);
+    }
+
+#ifdef WITH_NOTIFY
+    /* option : notification debounce window */
+
+    if (configuration.notification_debounce < 0) {
+        configuration.notification_debounce = DEFAULT_NOTIFICATION_DEBOUNCE;
+        print_error (_("Invalid notification debounce! It has been reset to default (%d milliseconds)\n"), DEFAULT_NOTIFICATION_DEBOUNCE);
+    }
+#endif
+}
+
+static void print_usage ()
+{
+    g_printf("Usage:\n"
+             "  cbatticon [OPTION...]\n"
+             "\n"
+             "Help Options:\n"
+             "  -h, --help                       Show help options\n"
+             "\n"
+             "Application Options:\n"
+             "  -v, --version                    Display the version\n"
+             "  -d, --debug                      Display debug information\n"
+             "  -b, --headless                   Run without tray icon (and without GTK)\n"
+             "  -P, --profile                    Time startup and updates, dumped on SIGUSR1 and at exit\n"
+             "  -u, --update-interval            Set update interval (in seconds)\n"
+             "  -m, --min-update-interval        Set minimum update interval when nearing a battery level (in seconds)\n"
+             "  -M, --max-update-interval        Set maximum update interval when the battery level is steady (in seconds)\n"
+             "  -f, --fallback-interval          Set update interval when battery events are available (in seconds)\n"
+             "  -i, --icon-type                  Set icon type ('standard', 'notification', 'gpm' or 'rendered')\n"
+             "  -l, --low-level                  Set low battery level (in percent)\n"
+             "  -r, --critical-level             Set critical battery level (in percent)\n"
+             "  -y, --level-hysteresis           Set how far above a level the battery must get before it is notified again (in percent)\n"
+             "  -o, --command-low-level          Command to execute when low battery level is reached\n"
+             "  -c, --command-critical-level     Command to execute when critical battery level is reached\n"
+             "  -x, --command-left-click         Command to execute when left clicking on tray icon\n"
+             "  -I, --icon-dir                   Set the directory to load the icons from\n"
+             "  -H, --history-file               Record the battery history in a file\n"
+             "  -S, --status-file                Publish the battery status in a memory-mapped file\n"
+             "  -B, --backend                    Set battery backend ('apm' or 'sysfs')\n"
+             "  -C, --config-file                Read options from a file, and again on SIGHUP\n"
+             "  -R, --icon-percentage            Draw the percentage on the rendered icons\n"
+             "  -D, --direct-draw                Draw the icon without image and tooltips widgets\n"
+             "  -T, --trace-file                 Record the recent events, dumped to a file on SIGUSR2\n"
+#ifdef WITH_NOTIFY
+             "  -n, --hide-notification          Hide the notification popups\n"
+             "  -N, --notification-debounce      Only show a notification once no newer one came for this delay (in milliseconds)\n"
+#endif
+             "  -t, --list-icon-types            List available icon types\n");
+}
+
+/*
+ * configuration file functions
+ */
+
+/* the keys of the [cbatticon] group, named after the long options */
+
+static const struct {
+    const gchar *key;
+    glong        offset;
+} config_file_integers[] = {
+    { "update-interval",       G_STRUCT_OFFSET (struct configuration, update_interval)       },
+    { "min-update-interval",   G_STRUCT_OFFSET (struct configuration, min_update_interval)   },
+    { "max-update-interval",   G_STRUCT_OFFSET (struct configuration, max_update_interval)   },
+    { "fallback-interval",     G_STRUCT_OFFSET (struct configuration, fallback_interval)     },
+    { "low-level",             G_STRUCT_OFFSET (struct configuration, low_level)             },
+    { "critical-level",        G_STRUCT_OFFSET (struct configuration, critical_level)        },
+    { "level-hysteresis",      G_STRUCT_OFFSET (struct configuration, level_hysteresis)      },
+#ifdef WITH_NOTIFY
+    { "notification-debounce", G_STRUCT_OFFSET (struct configuration, notification_debounce) },
+#endif
+}, config_file_strings[] = {
+    { "command-low-level",      G_STRUCT_OFFSET (struct configuration, command_low_level)      },
+    { "command-critical-level", G_STRUCT_OFFSET (struct configuration, command_critical_level) },
+    { "command-left-click",     G_STRUCT_OFFSET (struct configuration, command_left_click)     },
+};
+
+static gboolean load_config_file (const gchar *path, struct configuration *config, gchar **icon_type_string)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    GError *error = NULL;
+    guint i;
+
+    if (g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error) == FALSE) {
+        print_error (_("Cannot read configuration file: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+
+        g_key_file_free (key_file);
+        return FALSE;
+    }
+
+    /* a key that cannot be parsed keeps the value of the command line */
+
+    for (i = 0; i < G_N_ELEMENTS (config_file_integers); i++) {
+        gint value;
+
+        if (g_key_file_has_key (key_file, CBATTICON_STRING, config_file_integers[i].key, NULL) == FALSE) {
+            continue;
+        }
+
+        value = g_key_file_get_integer (key_file, CBATTICON_STRING, config_file_integers[i].key, &error);
+
+        if (error != NULL) {
+            print_error (_("Invalid \"%s\" in configuration file: %s\n"), config_file_integers[i].key, error->message);
+            g_error_free (error); error = NULL;
+            continue;
+        }
+
+        G_STRUCT_MEMBER (gint, config, config_file_integers[i].offset) = value;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (config_file_strings); i++) {
+        gchar *value = g_key_file_get_string (key_file, CBATTICON_STRING, config_file_strings[i].key, NULL);
+
+        if (value == NULL) {
+            continue;
+        }
+
+        /* an empty command disables the one of the command line */
+
+        if (value[0] == '\0') {
+            g_free (value); value = NULL;
+        }
+
+        G_STRUCT_MEMBER (gchar *, config, config_file_strings[i].offset) = value;
+    }
+
+    if (g_key_file_has_key (key_file, CBATTICON_STRING, "icon-percentage", NULL) == TRUE) {
+        gboolean value = g_key_file_get_boolean (key_file, CBATTICON_STRING, "icon-percentage", &error);
+
+        if (error != NULL) {
+            print_error (_("Invalid \"%s\" in configuration file: %s\n"), "icon-percentage", error->message);
+            g_error_free (error); error = NULL;
+        } else {
+            config->icon_percentage = value;
+        }
+    }
+
+#ifdef WITH_NOTIFY
+    if (g_key_file_has_key (key_file, CBATTICON_STRING, "hide-notification", NULL) == TRUE) {
+        gboolean value = g_key_file_get_boolean (key_file, CBATTICON_STRING, "hide-notification", &error);
+
+        if (error != NULL) {
+            print_error (_("Invalid \"%s\" in configuration file: %s\n"), "hide-notification", error->message);
+            g_error_free (error); error = NULL;
+        } else {
+            config->hide_notification = value;
+        }
+    }
+#endif
+
+    if (g_key_file_has_key (key_file, CBATTICON_STRING, "icon-type", NULL) == TRUE) {
+        g_free (*icon_type_string);
+        *icon_type_string = g_key_file_get_string (key_file, CBATTICON_STRING, "icon-type", NULL);
+    }
+
+    g_key_file_free (key_file);
+
+    return TRUE;
+}
+
+static void free_config_file_strings (struct configuration *config, const struct configuration *base)
+{
+    guint i;
+
+    /* the strings that do not come from the command line were read from the file */
+
+    for (i = 0; i < G_N_ELEMENTS (config_file_strings); i++) {
+        gchar **value = &G_STRUCT_MEMBER (gchar *, config, config_file_strings[i].offset);
+
+        if (*value != G_STRUCT_MEMBER (gchar *, base, config_file_strings[i].offset)) {
+            g_free (*value);
+        }
+    }
+}
+
+static void reload_configuration (void)
+{
+    struct configuration reloaded = command_line_configuration;
+    gchar *icon_type_string = g_strdup (command_line_icon_type);
+    gint icon_type = configuration.icon_type;
+    gboolean icon_percentage = configuration.icon_percentage;
+    struct icon *tray_icon;
+
+    /* an unreadable file keeps the current configuration */
+
+    if (load_config_file (configuration.config_file, &reloaded, &icon_type_string) == FALSE) {
+        g_free (icon_type_string);
+        return;
+    }
+
+    free_config_file_strings (&configuration, &command_line_configuration);
+
+    /* an unknown icon type keeps the current one, no icon type at all falls back to the first available one */
+
+    reloaded.icon_type = icon_type_string != NULL ? icon_type : UNKNOWN_ICON;
+
+    configuration = reloaded;
+    validate_configuration (icon_type_string);
+    g_free (icon_type_string);
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("configuration reloaded from %s\n", configuration.config_file);
+    }
+
+    prepare_spawn_commands ();
+
+    /* the rendered icons are drawn again without or with the percentage */
+
+    if (configuration.icon_percentage != icon_percentage && rendered_icons != NULL) {
+        g_hash_table_remove_all (rendered_icons);
+    }
+
+    /* only a new icon type has icons to load, the cache keeps the previous ones around,
+       and the icon ids of another icon type are not shown again */
+
+    if (configuration.icon_type != icon_type || configuration.icon_percentage != icon_percentage) {
+        for (tray_icon = tray_icons; tray_icon != NULL; tray_icon = tray_icon->next) {
+            if (configuration.icon_type != icon_type) {
+                load_tray_icons (tray_icon);
+            }
+
+            tray_icon->rendered.icon_id = -1;
+        }
+    }
+
+    /* the new levels and intervals apply at once, the update source being replaced only if its interval changed */
+
+    update_tray_icon (tray_icons);
+}
+
+static gboolean on_reload_signal (gpointer user_data)
+{
+    reload_configuration ();
+
+    return TRUE;
+}
+
+/*
+ * battery backend functions
+ */
+
+static const struct battery_backend battery_backends[] = {
+    { "apm",   apm_backend_open,   apm_backend_read,   apm_backend_open_events,   apm_backend_read_events,   apm_backend_close   },
+    { "sysfs", sysfs_backend_open, sysfs_backend_read, sysfs_backend_open_events, sysfs_backend_read_events, sysfs_backend_close }
+};
+
+static const struct battery_backend *battery_backend = NULL;
+
+static gboolean open_battery_backend (const gchar *name)
+{
+    guint i;
+
+    /* without a name, the first backend that opens is used */
+
+    for (i = 0; i < G_N_ELEMENTS (battery_backends); i++) {
+        if (name != NULL && g_strcmp0 (name, battery_backends[i].name) != 0) {
+            continue;
+        }
+
+        if (battery_backends[i].open () == TRUE) {
+            battery_backend = &battery_backends[i];
+
+            if (configuration.debug_output == TRUE) {
+                debug_printf ("battery backend: %s\n", battery_backend->name);
+            }
+
+            return TRUE;
+        }
+
+        if (name != NULL) {
+            print_error (_("Cannot open battery backend: %s\n"), name);
+            return FALSE;
+        }
+    }
+
+    if (name != NULL) {
+        print_error (_("Unknown battery backend: %s\n"), name);
+    } else {
+        print_error (_("No battery backend available!\n"));
+    }
+
+    return FALSE;
+}
+
+static void close_battery_backend (void)
+{
+    if (battery_backend != NULL) {
+        battery_backend->close ();
+        battery_backend = NULL;
+    }
+}
+
+static gboolean read_battery_info (struct battery_info *info)
+{
+    /* the aggregate status is the most significant one among the batteries */
+    static const gint status_priorities[] = {
+        [MISSING] = 0, [UNKNOWN] = 1, [CHARGED] = 2, [NOTCHARGING] = 3, [DISCHARGING] = 4, [CHARGING] = 5
+    };
+
+    gdouble capacity = 0, charge = 0;
+    guint i;
+
+    info->batteries = 0;
+
+    if (battery_backend->read (info) == FALSE) {
+        return FALSE;
+    }
+
+    info->status     = MISSING;
+    info->percentage = 0;
+
+    for (i = 0; i < info->batteries; i++) {
+        if (status_priorities[info->battery_status[i]] > status_priorities[info->status]) {
+            info->status = info->battery_status[i];
+        }
+
+        if (info->battery_status[i] != MISSING) {
+            capacity += info->battery_capacity[i];
+            charge   += info->battery_capacity[i] * info->battery_percentage[i];
+        }
+    }
+
+    if (capacity > 0) {
+        info->percentage = (gint)(charge / capacity + 0.5);
+    }
+
+    return TRUE;
+}
+
+static gboolean read_battery_file (gint fd, gchar *buffer, gsize size)
+{
+    gssize length;
+
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    length = pread (fd, buffer, size - 1, 0);
+
+    if (length <= 0) {
+        return FALSE;
+    }
+
+    buffer[length] = '\0';
+    g_strchomp (buffer);
+
+    return TRUE;
+}
+
+/*
+ * apm backend functions
+ */
+
+static gint apm_proc_fd = -1;
+
+static gboolean parse_apm_info (const gchar *buffer, struct battery_info *info)
+{
+    gchar driver_version[10], units[10];
+    gint apm_version_major, apm_version_minor, battery_percentage, battery_time;
+    guint apm_flags, ac_line_status, battery_status, battery_flags;
+
+    g_return_val_if_fail (buffer != NULL, FALSE);
+    g_return_val_if_fail (info != NULL, FALSE);
+
+    /* same format as libapm: 1.16ac 1.2 0x03 0x01 0x03 0x09 100% -1 ? */
+
+    if (sscanf (buffer, "%9s %d.%d %x %x %x %x %d%% %d %9s",
+                driver_version, &apm_version_major, &apm_version_minor, &apm_flags,
+                &ac_line_status, &battery_status, &battery_flags,
+                &battery_percentage, &battery_time, units) != 10) {
+        return FALSE;
+    }
+
+    /* /proc/apm only knows about the batteries as a whole */
+
+    info->batteries             = 1;
+    info->ac_line_status        = ac_line_status;
+    info->battery_percentage[0] = battery_percentage;
+    info->battery_capacity[0]   = 1;
+
+    if (battery_time < 0) {
+        info->battery_time[0] = -1;
+    } else if (strncmp (units, "min", 3) == 0) {
+        info->battery_time[0] = battery_time;
+    } else {
+        info->battery_time[0] = (battery_time + 30) / 60;
+    }
+
+    switch (battery_status) {
+        case 0x00: /* High */
+        case 0x01: /* Low */
+        case 0x02: /* Critical */
+            info->battery_status[0] = DISCHARGING;
+            break;
+        case 0x03: /* Charging */
+            if (battery_percentage == 100) {
+                info->battery_status[0] = CHARGED;
+            } else {
+                info->battery_status[0] = CHARGING;
+            }
+            break;
+        case 0x04: /* Selected battery not present */
+            info->battery_status[0] = MISSING;
+            break;
+        default:
+            info->battery_status[0] = UNKNOWN;
+            break;
+    }
+
+    if (battery_flags & (1 << 3) || ac_line_status == 0x01) {
+        if (battery_percentage == 100) {
+            info->battery_status[0] = CHARGED;
+        } else {
+            info->battery_status[0] = CHARGING;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean apm_backend_open (void)
+{
+    struct battery_info info;
+
+    apm_proc_fd = open (APM_PROC, O_RDONLY);
+
+    if (apm_proc_fd < 0) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("cannot open %s: no APM support in kernel\n", APM_PROC);
+        }
+
+        return FALSE;
+    }
+
+    /* older kernels use another format */
+
+    if (apm_backend_read (&info) == FALSE) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("cannot parse %s: old APM support in kernel\n", APM_PROC);
+        }
+
+        apm_backend_close ();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean apm_backend_read (struct battery_info *info)
+{
+    gchar buffer[STR_LTH];
+
+    if (read_battery_file (apm_proc_fd, buffer, sizeof (buffer)) == FALSE) {
+        return FALSE;
+    }
+
+    return parse_apm_info (buffer, info);
+}
+
+static gint apm_backend_open_events (void)
+{
+    /*
+     * open the device read-only: the kernel waits for every writer
+     * to acknowledge suspend requests, and we have nothing to say about them
+     */
+
+    gint fd = open (APM_DEVICE, O_RDONLY);
+
+    if (fd < 0 && configuration.debug_output == TRUE) {
+        debug_printf ("cannot open %s, falling back to polling\n", APM_DEVICE);
+    }
+
+    return fd;
+}
+
+static gboolean apm_backend_read_events (gint fd)
+{
+    apm_event_t events[8];
+    gint i, count;
+
+    count = apm_get_events (fd, 0, events, G_N_ELEMENTS (events));
+
+    for (i = 0; i < count; i++) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("apm event: 0x%04x\n", events[i]);
+        }
+
+        /* the clocks may not tell on kernels without CLOCK_BOOTTIME, that apm machines tend to run */
+
+        if (events[i] == APM_NORMAL_RESUME || events[i] == APM_CRITICAL_RESUME || events[i] == APM_STANDBY_RESUME) {
+            forget_battery_time_estimation_samples ();
+        }
+    }
+
+    return TRUE;
+}
+
+static void apm_backend_close (void)
+{
+    if (apm_proc_fd >= 0) {
+        close (apm_proc_fd);
+        apm_proc_fd = -1;
+    }
+}
+
+/*
+ * sysfs backend functions
+ *
+ * the batteries (up to MAX_BATTERIES) and the first mains supply found in /sys/class/power_supply are used
+ */
+
+enum {
+    SYSFS_BATTERY_STATUS = 0,
+    SYSFS_BATTERY_PRESENT,
+    SYSFS_BATTERY_CAPACITY,
+    SYSFS_BATTERY_NOW,      /* energy_now (uWh) or charge_now (uAh) */
+    SYSFS_BATTERY_RATE,     /* power_now (uW) or current_now (uA) */
+    SYSFS_BATTERY_FILES
+};
+
+static gint    sysfs_battery_fds[MAX_BATTERIES][SYSFS_BATTERY_FILES];
+static gdouble sysfs_battery_capacities[MAX_BATTERIES];
+static guint   sysfs_batteries = 0;
+static gint    sysfs_ac_online_fd = -1;
+
+static gint open_sysfs_file (const gchar *supply, const gchar *name)
+{
+    gchar path[STR_LTH];
+
+    g_snprintf (path, STR_LTH, "%s/%s/%s", SYSFS_POWER_SUPPLY_PATH, supply, name);
+
+    return open (path, O_RDONLY);
+}
+
+static gboolean get_sysfs_supply_attribute (const gchar *supply, const gchar *name, gchar *value, gsize size)
+{
+    gint fd = open_sysfs_file (supply, name);
+    gboolean found = read_battery_file (fd, value, size);
+
+    if (fd >= 0) {
+        close (fd);
+    }
+
+    return found;
+}
+
+static gboolean read_sysfs_value (gint fd, glong *value);
+static void sysfs_backend_close (void);
+
+static gboolean scan_sysfs_supplies (void)
+{
+    GDir *directory;
+    const gchar *supply;
+    gchar type[STR_LTH], scope[STR_LTH];
+
+    directory = g_dir_open (SYSFS_POWER_SUPPLY_PATH, 0, NULL);
+
+    if (directory == NULL) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("cannot open %s\n", SYSFS_POWER_SUPPLY_PATH);
+        }
+
+        return FALSE;
+    }
+
+    while ((supply = g_dir_read_name (directory)) != NULL) {
+        if (get_sysfs_supply_attribute (supply, "type", type, sizeof (type)) == FALSE) {
+            continue;
+        }
+
+        /* the batteries of peripherals (mice, keyboards, ...) do not power the machine */
+
+        if (get_sysfs_supply_attribute (supply, "scope", scope, sizeof (scope)) == TRUE && g_strcmp0 (scope, "Device") == 0) {
+            continue;
+        }
+
+        if (g_strcmp0 (type, "Battery") == 0 && sysfs_batteries < MAX_BATTERIES) {
+            gint *fds = sysfs_battery_fds[sysfs_batteries];
+            gint full_fd;
+            glong full = 0;
+
+            fds[SYSFS_BATTERY_STATUS]   = open_sysfs_file (supply, "status");
+            fds[SYSFS_BATTERY_PRESENT]  = open_sysfs_file (supply, "present");
+            fds[SYSFS_BATTERY_CAPACITY] = open_sysfs_file (supply, "capacity");
+
+            /* the remaining energy, the rate and the full capacity have to be given in the same unit */
+
+            fds[SYSFS_BATTERY_NOW] = open_sysfs_file (supply, "energy_now");
+
+            if (fds[SYSFS_BATTERY_NOW] >= 0) {
+                fds[SYSFS_BATTERY_RATE] = open_sysfs_file (supply, "power_now");
+                full_fd                 = open_sysfs_file (supply, "energy_full");
+            } else {
+                fds[SYSFS_BATTERY_NOW]  = open_sysfs_file (supply, "charge_now");
+                fds[SYSFS_BATTERY_RATE] = open_sysfs_file (supply, "current_now");
+                full_fd                 = open_sysfs_file (supply, "charge_full");
+            }
+
+            /* the full capacity only weights the battery in the aggregate, it is read once */
+
+            if (read_sysfs_value (full_fd, &full) == FALSE || full <= 0) {
+                full = 1;
+            }
+
+            if (full_fd >= 0) {
+                close (full_fd);
+            }
+
+            sysfs_battery_capacities[sysfs_batteries] = full;
+            sysfs_batteries++;
+
+            if (configuration.debug_output == TRUE) {
+                debug_printf ("sysfs battery: %s (full capacity %ld)\n", supply, full);
+            }
+        } else if (g_strcmp0 (type, "Mains") == 0 && sysfs_ac_online_fd < 0) {
+            sysfs_ac_online_fd = open_sysfs_file (supply, "online");
+
+            if (configuration.debug_output == TRUE) {
+                debug_printf ("sysfs ac: %s\n", supply);
+            }
+        }
+    }
+
+    g_dir_close (directory);
+
+    return TRUE;
+}
+
+static gboolean sysfs_backend_open (void)
+{
+    if (scan_sysfs_supplies () == FALSE) {
+        return FALSE;
+    }
+
+    /* without battery, the next backend (or the error) is up */
+
+    if (sysfs_batteries == 0) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("no battery in %s\n", SYSFS_POWER_SUPPLY_PATH);
+        }
+
+        sysfs_backend_close ();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void rescan_sysfs_supplies (void)
+{
+    /* the batteries may come and go once opened, the ones that are left are reported as missing */
+
+    sysfs_backend_close ();
+    scan_sysfs_supplies ();
+    reset_battery_time_estimation ();
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("sysfs supplies rescanned: %u batteries\n", sysfs_batteries);
+    }
+}
+
+static gboolean read_sysfs_value (gint fd, glong *value)
+{
+    gchar buffer[STR_LTH];
+    gchar *end;
+
+    if (read_battery_file (fd, buffer, sizeof (buffer)) == FALSE) {
+        return FALSE;
+    }
+
+    *value = strtol (buffer, &end, 10);
+
+    return end != buffer;
+}
+
+static void read_sysfs_battery (gint *fds, gint *battery_status, gint *battery_percentage, gint *battery_time)
+{
+    gchar status[STR_LTH];
+    glong present, capacity, now, rate;
+
+    *battery_status     = MISSING;
+    *battery_percentage = 0;
+    *battery_time       = -1;
+
+    if (read_battery_file (fds[SYSFS_BATTERY_STATUS], status, sizeof (status)) == FALSE) {
+        return;
+    }
+
+    if (read_sysfs_value (fds[SYSFS_BATTERY_PRESENT], &present) == TRUE && present == 0) {
+        return;
+    }
+
+    if (read_sysfs_value (fds[SYSFS_BATTERY_CAPACITY], &capacity) == TRUE) {
+        *battery_percentage = CLAMP (capacity, 0, 100);
+    }
+
+    if (g_strcmp0 (status, "Charging") == 0) {
+        *battery_status = *battery_percentage == 100 ? CHARGED : CHARGING;
+    } else if (g_strcmp0 (status, "Discharging") == 0) {
+        *battery_status = DISCHARGING;
+    } else if (g_strcmp0 (status, "Not charging") == 0) {
+        *battery_status = NOTCHARGING;
+    } else if (g_strcmp0 (status, "Full") == 0) {
+        *battery_status = CHARGED;
+    } else {
+        *battery_status = UNKNOWN;
+    }
+
+    /* the remaining time while charging is left to the estimation */
+
+    if (*battery_status == DISCHARGING &&
+        read_sysfs_value (fds[SYSFS_BATTERY_NOW], &now) == TRUE &&
+        read_sysfs_value (fds[SYSFS_BATTERY_RATE], &rate) == TRUE && rate > 0) {
+        *battery_time = (gint)(now * 60.0 / rate);
+    }
+}
+
+static gboolean sysfs_backend_read (struct battery_info *info)
+{
+    glong ac_online;
+    guint i;
+
+    info->ac_line_status = 0xff;
+
+    if (read_sysfs_value (sysfs_ac_online_fd, &ac_online) == TRUE) {
+        info->ac_line_status = ac_online != 0 ? 0x01 : 0x00;
+    }
+
+    /* a machine without battery is reported as a missing battery */
+
+    info->batteries = MAX (sysfs_batteries, 1);
+
+    info->battery_status[0]     = MISSING;
+    info->battery_percentage[0] = 0;
+    info->battery_time[0]       = -1;
+    info->battery_capacity[0]   = 1;
+
+    for (i = 0; i < sysfs_batteries; i++) {
+        read_sysfs_battery (sysfs_battery_fds[i], &info->battery_status[i], &info->battery_percentage[i], &info->battery_time[i]);
+        info->battery_capacity[i] = sysfs_battery_capacities[i];
+    }
+
+    return TRUE;
+}
+
+static gint sysfs_backend_open_events (void)
+{
+    struct sockaddr_nl address;
+    gint fd;
+
+    /* the kernel broadcasts a power_supply uevent when a supply changes */
+
+    fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset (&address, 0, sizeof (address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+
+    if (bind (fd, (struct sockaddr *)&address, sizeof (address)) < 0) {
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("cannot listen to uevents, falling back to polling\n");
+        }
+
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static gboolean sysfs_backend_read_events (gint fd)
+{
+    gchar buffer[4096];
+    gssize length;
+    gchar *variable;
+    gboolean changed = FALSE, rescan = FALSE;
+
+    while ((length = recv (fd, buffer, sizeof (buffer) - 1, MSG_DONTWAIT)) > 0) {
+        buffer[length] = '\0';
+
+        /* "action@devpath", followed by the NUL separated uevent variables */
+
+        for (variable = buffer; variable < buffer + length; variable += strlen (variable) + 1) {
+            if (g_strcmp0 (variable, "SUBSYSTEM=power_supply") == 0) {
+                if (configuration.debug_output == TRUE) {
+                    debug_printf ("uevent: %s\n", buffer);
+                }
+
+                /* a supply was plugged in or removed, the others only changed */
+
+                if (g_str_has_prefix (buffer, "add@") || g_str_has_prefix (buffer, "remove@")) {
+                    rescan = TRUE;
+                }
+
+                changed = TRUE;
+                break;
+            }
+        }
+    }
+
+    if (rescan == TRUE) {
+        rescan_sysfs_supplies ();
+    }
+
+    return changed;
+}
+
+static void sysfs_backend_close (void)
+{
+    guint i, j;
+
+    for (i = 0; i < sysfs_batteries; i++) {
+        for (j = 0; j < SYSFS_BATTERY_FILES; j++) {
+            if (sysfs_battery_fds[i][j] >= 0) {
+                close (sysfs_battery_fds[i][j]);
+            }
+        }
+    }
+
+    sysfs_batteries = 0;
+
+    if (sysfs_ac_online_fd >= 0) {
+        close (sysfs_ac_online_fd);
+        sysfs_ac_online_fd = -1;
+    }
+}
+
+/*
+ * computation functions
+ */
+
+static gboolean get_battery_charge (struct battery_info *info, gboolean remaining, gint *percentage, gint *time, gdouble *rate)
+{
+    gdouble capacity = 0, left = 0, flow = 0;
+    guint i;
+
+    g_return_val_if_fail (percentage != NULL, FALSE);
+
+    *percentage = info->percentage;
+
+    if (time == NULL) {
+        return TRUE;
+    }
+
+    /*
+     * the time is the capacity left to discharge (or to charge) over the flow of all the batteries,
+     * a battery of unknown rate (such as an idle one) only adds its capacity left
+     */
+
+    for (i = 0; i < info->batteries; i++) {
+        struct estimation *estimation = &estimations[i];
+        gdouble battery_left;
+        gint battery_time = -1;
+
+        if (info->battery_status[i] == MISSING) {
+            continue;
+        }
+
+        if (estimation->status != info->battery_status[i]) {
+            estimation->status = info->battery_status[i];
+            estimation->head   = 0;
+            estimation->count  = 0;
+            estimation->rate   = 0;
+        }
+
+        if (remaining == FALSE) {
+            battery_left = (100 - info->battery_percentage[i]) * info->battery_capacity[i];
+
+            if (info->battery_status[i] == CHARGING) {
+                get_battery_time_estimation (estimation, info->battery_percentage[i], 100, &battery_time);
+            }
+        } else {
+            battery_left = info->battery_percentage[i] * info->battery_capacity[i];
+            battery_time = info->battery_time[i];
+
+            if (battery_time < 0) {
+                get_battery_time_estimation (estimation, info->battery_percentage[i], 0, &battery_time);
+            }
+        }
+
+        capacity += info->battery_capacity[i];
+        left     += battery_left;
+
+        if (battery_time >= 0 && battery_left > 0) {
+            flow += battery_left / MAX (battery_time, 1);
+        }
+    }
+
+    *time = flow > 0 ? (gint)(left / flow) : -1;
+
+    if (rate != NULL) {
+        /* in percent of the whole capacity per second */
+        *rate = capacity > 0 ? (remaining == TRUE ? -flow : flow) / (capacity * 60) : 0;
+    }
+
+    return TRUE;
+}
+
+static gboolean get_battery_time_estimation (struct estimation *estimation, gdouble remaining_capacity, gdouble y, gint *time)
+{
+    gdouble now = g_get_monotonic_time () / (gdouble)G_USEC_PER_SEC;
+    struct estimation_sample *last;
+    gdouble estimation_seconds;
+
+    /* only the capacity changes carry information */
+
+    last = &estimation->samples[(estimation->head + ESTIMATION_SAMPLES - 1) % ESTIMATION_SAMPLES];
+
+    if (estimation->count == 0 || remaining_capacity != last->remaining_capacity) {
+        add_battery_time_estimation_sample (estimation, now, remaining_capacity);
+        last = &estimation->samples[(estimation->head + ESTIMATION_SAMPLES - 1) % ESTIMATION_SAMPLES];
+    }
+
+    /*
+     * y = mx + b ... x = (y - b) / m
+     * solving for when y = 0 (discharging) or full_capacity (charging)
+     * counting from the last capacity change
+     */
+
+    if (estimation->rate == 0 || (y - remaining_capacity) / estimation->rate < 0) {
+        *time = -1;
+        return TRUE;
+    }
+
+    estimation_seconds = (y - last->remaining_capacity) / estimation->rate - (now - last->seconds);
+
+    *time = (gint)(MAX (estimation_seconds, 0) / 60.0);
+
+    return TRUE;
+}
+
+static void add_battery_time_estimation_sample (struct estimation *estimation, gdouble seconds, gdouble remaining_capacity)
+{
+    struct estimation_sample *samples = estimation->samples;
+    gdouble mean_seconds = 0, mean_capacity = 0, covariance = 0, variance = 0;
+    guint i;
+
+    samples[estimation->head].seconds            = seconds;
+    samples[estimation->head].remaining_capacity = remaining_capacity;
+
+    estimation->head = (estimation->head + 1) % ESTIMATION_SAMPLES;
+
+    if (estimation->count < ESTIMATION_SAMPLES) {
+        estimation->count++;
+    }
+
+    /*
+     * a first rate is available as soon as the capacity changed once,
+     * until then the rate (0 after a reset, the last fit after a suspend) is kept
+     */
+
+    if (estimation->count < 2) {
+        return;
+    }
+
+    for (i = 0; i < estimation->count; i++) {
+        mean_seconds  += samples[i].seconds;
+        mean_capacity += samples[i].remaining_capacity;
+    }
+
+    mean_seconds  /= estimation->count;
+    mean_capacity /= estimation->count;
+
+    for (i = 0; i < estimation->count; i++) {
+        gdouble delta_seconds = samples[i].seconds - mean_seconds;
+
+        covariance += delta_seconds * (samples[i].remaining_capacity - mean_capacity);
+        variance   += delta_seconds * delta_seconds;
+    }
+
+    estimation->rate = variance > 0 ? covariance / variance : 0;
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("estimated rate of battery %d: %f percent per minute over %u samples\n",
+                  (gint)(estimation - estimations) + 1, estimation->rate * 60, estimation->count);
+    }
+}
+
+static void reset_battery_time_estimation (void)
+{
+    guint i;
+
+    for (i = 0; i < MAX_BATTERIES; i++) {
+        estimations[i].head   = 0;
+        estimations[i].count  = 0;
+        estimations[i].rate   = 0;
+        estimations[i].status = -1;
+    }
+}
+
+static void forget_battery_time_estimation_samples (void)
+{
+    guint i;
+
+    /*
+     * the monotonic clock stops during a suspend, but the batteries do not:
+     * the samples taken before it would make a steep slope out of the capacity lost meanwhile,
+     * only their rate is kept as a first estimation after the resume
+     */
+
+    for (i = 0; i < MAX_BATTERIES; i++) {
+        estimations[i].head  = 0;
+        estimations[i].count = 0;
+    }
+}
+
+static gint64 get_suspended_time (void)
+{
+    static gint64 last_offset = -1;
+    struct timespec boottime, monotonic;
+    gint64 offset, suspended;
+
+    /* the boottime clock keeps counting during a suspend, the gap between both clocks is the time spent suspended */
+
+    if (clock_gettime (CLOCK_BOOTTIME, &boottime) < 0 || clock_gettime (CLOCK_MONOTONIC, &monotonic) < 0) {
+        return 0;
+    }
+
+    offset = (boottime.tv_sec - monotonic.tv_sec) * G_USEC_PER_SEC + (boottime.tv_nsec - monotonic.tv_nsec) / 1000;
+
+    suspended   = last_offset >= 0 ? offset - last_offset : 0;
+    last_offset = offset;
+
+    return suspended > SUSPEND_SLACK * G_USEC_PER_SEC ? suspended : 0;
+}
+
+/*
+ * history functions
+ *
+ * the samples are appended to a fixed-size ring file, mapped in memory,
+ * each time the percentage, the status or the ac line status changes
+ * (the file uses the host byte order)
+ */
+
+struct history_header {
+    guint32 magic;
+    guint32 capacity;
+    guint32 head;
+    guint32 count;
+};
+
+struct history_sample {
+    gint64  timestamp;      /* in seconds since the epoch */
+    guint8  percentage;
+    guint8  status;
+    guint8  ac_line_status;
+    guint8  reserved;
+    gint32  time;           /* in minutes, -1 if unknown */
+};
+
+static struct history_header *history          = NULL;
+static struct history_sample *history_samples  = NULL;
+static guint                  history_unsynced = 0;
+
+#define HISTORY_SIZE (sizeof (struct history_header) + HISTORY_SAMPLES * sizeof (struct history_sample))
+
+static gboolean open_history (const gchar *path)
+{
+    gint fd = open (path, O_RDWR | O_CREAT, 0644);
+    gpointer map;
+
+    if (fd < 0 || ftruncate (fd, HISTORY_SIZE) < 0) {
+        print_error (_("Cannot open history file %s: %s\n"), path, g_strerror (errno));
+
+        if (fd >= 0) {
+            close (fd);
+        }
+
+        return FALSE;
+    }
+
+    map = mmap (NULL, HISTORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (map == MAP_FAILED) {
+        print_error (_("Cannot open history file %s: %s\n"), path, g_strerror (errno));
+        return FALSE;
+    }
+
+    history         = map;
+    history_samples = (struct history_sample *)(history + 1);
+
+    if (history->magic != HISTORY_MAGIC || history->capacity != HISTORY_SAMPLES || history->head >= HISTORY_SAMPLES) {
+        history->magic    = HISTORY_MAGIC;
+        history->capacity = HISTORY_SAMPLES;
+        history->head     = 0;
+        history->count    = 0;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("history: %u samples in %s\n", history->count, path);
+    }
+
+    return TRUE;
+}
+
+static void record_history_sample (struct battery_info *info, const struct battery_state *state)
+{
+    static gint old_status = -1, old_percentage = -1, old_ac_line_status = -1;
+    struct history_sample *sample;
+
+    if (history == NULL || state->status < 0) {
+        return;
+    }
+
+    if (state->status == old_status && state->percentage == old_percentage && info->ac_line_status == old_ac_line_status) {
+        return;
+    }
+
+    old_status         = state->status;
+    old_percentage     = state->percentage;
+    old_ac_line_status = info->ac_line_status;
+
+    sample = &history_samples[history->head];
+    sample->timestamp      = g_get_real_time () / G_USEC_PER_SEC;
+    sample->percentage     = state->percentage;
+    sample->status         = state->status;
+    sample->ac_line_status = info->ac_line_status;
+    sample->reserved       = 0;
+    sample->time           = state->time;
+
+    history->head = (history->head + 1) % HISTORY_SAMPLES;
+
+    if (history->count < HISTORY_SAMPLES) {
+        history->count++;
+    }
+
+    /* let the kernel write the pages back in batches */
+
+    if (++history_unsynced >= HISTORY_SYNC_SAMPLES) {
+        msync (history, HISTORY_SIZE, MS_ASYNC);
+        history_unsynced = 0;
+    }
+}
+
+static void load_history_estimation_samples (gint status)
+{
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    gdouble monotonic_now = g_get_monotonic_time () / (gdouble)G_USEC_PER_SEC;
+    struct estimation *estimation = &estimations[0];
+    guint first, i, count = 0;
+
+    /* the history holds the aggregate, it only warms up the estimation of a single battery */
+
+    if (history == NULL || history->count == 0) {
+        return;
+    }
+
+    /* only pick up a recent run of the same status, left by a previous instance */
+
+    for (i = 0; i < history->count && count < ESTIMATION_SAMPLES; i++) {
+        struct history_sample *sample = &history_samples[(history->head + HISTORY_SAMPLES - 1 - i) % HISTORY_SAMPLES];
+
+        if (sample->status != status || (i == 0 && now - sample->timestamp > HISTORY_WARM_START_AGE)) {
+            break;
+        }
+
+        count++;
+    }
+
+    first = (history->head + HISTORY_SAMPLES - count) % HISTORY_SAMPLES;
+
+    for (i = 0; i < count; i++) {
+        struct history_sample *sample = &history_samples[(first + i) % HISTORY_SAMPLES];
+
+        if (estimation->count > 0 && estimation->samples[(estimation->head + ESTIMATION_SAMPLES - 1) % ESTIMATION_SAMPLES].remaining_capacity == sample->percentage) {
+            continue;
+        }
+
+        add_battery_time_estimation_sample (estimation, monotonic_now - (now - sample->timestamp), sample->percentage);
+    }
+
+    /* the samples were taken in this status, get_battery_charge () must not discard them */
+
+    estimation->status = status;
+
+    if (configuration.debug_output == TRUE && count > 0) {
+        debug_printf ("history: warm start with %u samples\n", estimation->count);
+    }
+}
+
+/*
+ * status export functions
+ *
+ * the last battery state is published in a small memory-mapped file
+ * that other programs can map and read without any system call, the
+ * sequence number is odd while the state is being written (seqlock)
+ */
+
+struct exported_status {
+    guint32       magic;
+    volatile gint sequence;
+    gint32        status;
+    gint32        percentage;
+    gint32        time;         /* in minutes, -1 if unknown */
+    guint32       flags;        /* 1 if low level reached, 2 if critical level reached */
+    gint64        timestamp;    /* in seconds since the epoch */
+};
+
+static struct exported_status *exported_status = NULL;
+
+static gboolean open_status_export (const gchar *path)
+{
+    gint fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    gpointer map;
+
+    if (fd < 0 || ftruncate (fd, sizeof (struct exported_status)) < 0) {
+        print_error (_("Cannot open status file %s: %s\n"), path, g_strerror (errno));
+
+        if (fd >= 0) {
+            close (fd);
+        }
+
+        return FALSE;
+    }
+
+    map = mmap (NULL, sizeof (struct exported_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (map == MAP_FAILED) {
+        print_error (_("Cannot open status file %s: %s\n"), path, g_strerror (errno));
+        return FALSE;
+    }
+
+    exported_status         = map;
+    exported_status->status = -1;
+    exported_status->magic  = STATUS_MAGIC;
+
+    return TRUE;
+}
+
+static void publish_status (const struct battery_state *state)
+{
+    if (exported_status == NULL) {
+        return;
+    }
+
+    if (exported_status->status == state->status && exported_status->percentage == state->percentage &&
+        exported_status->time == state->time && exported_status->flags == state->flags) {
+        return;
+    }
+
+    /* g_atomic_int_inc() is also a full memory barrier */
+
+    g_atomic_int_inc (&exported_status->sequence);
+
+    exported_status->status     = state->status;
+    exported_status->percentage = state->percentage;
+    exported_status->time       = state->time;
+    exported_status->flags      = state->flags;
+    exported_status->timestamp  = g_get_real_time () / G_USEC_PER_SEC;
+
+    g_atomic_int_inc (&exported_status->sequence);
+}
+
+/*
+ * spawn helper functions
+ *
+ * the helper is forked once the options are read, when a command is set, and before gtk_init (),
+ * while the process is still small:
+ * the commands are sent to it over a pipe as pre-parsed argument vectors, and it spawns them
+ * with posix_spawnp (), so that running a command at critical battery neither copies the
+ * page tables of the whole gtk process nor depends on its memory footprint
+ */
+
+enum {
+    SPAWN_COMMAND_LOW_LEVEL = 0,    /* = DEFERRED_COMMAND_LOW_LEVEL */
+    SPAWN_COMMAND_CRITICAL_LEVEL,   /* = DEFERRED_COMMAND_CRITICAL_LEVEL */
+    SPAWN_COMMAND_LEFT_CLICK,
+    SPAWN_COMMANDS
+};
+
+#define SPAWN_ARGUMENTS_MAX 64
+
+struct spawn_request {
+    guint32 index;
+    guint32 length;     /* of the arguments that follow, each one terminated by a null byte */
+};
+
+struct spawn_reply {
+    guint32 index;
+    gint32  error;      /* as returned by posix_spawnp () */
+};
+
+/* a request fits in a single atomic write to the pipe */
+#define SPAWN_REQUEST_MAX PIPE_BUF
+
+struct spawn_command {
+    gchar      **command;
+    gboolean     critical;
+    const gchar *error_message;
+    const gchar *notify_summary;
+    gchar       *parsed_command;    /* the command line that argv and request were parsed from */
+    gchar      **argv;
+    gchar       *request;
+    gsize        request_length;    /* 0 if the request does not fit in the pipe */
+};
+
+static struct spawn_command spawn_commands[SPAWN_COMMANDS] = {
+    {
+        &configuration.command_low_level,
+        TRUE,
+        N_("Cannot spawn low battery level command: %s\n"),
+        N_("Cannot spawn low battery level command!"),
+        NULL, NULL, NULL, 0
+    },
+    {
+        &configuration.command_critical_level,
+        TRUE,
+        N_("Cannot spawn critical battery level command: %s\n"),
+        N_("Cannot spawn critical battery level command!"),
+        NULL, NULL, NULL, 0
+    },
+    {
+        &configuration.command_left_click,
+        FALSE,
+        N_("Cannot spawn left click command: %s\n"),
+        N_("Cannot spawn left click command!"),
+        NULL, NULL, NULL, 0
+    }
+};
+
+extern char **environ;
+
+static gint spawn_request_fd = -1;
+static gint spawn_reply_fd   = -1;
+
+static void start_spawn_helper (void)
+{
+    gint requests[2], replies[2];
+    GIOChannel *channel;
+    pid_t pid;
+
+    if (pipe (requests) < 0) {
+        print_error (_("Cannot start spawn helper: %s\n"), g_strerror (errno));
+        return;
+    }
+
+    if (pipe (replies) < 0) {
+        print_error (_("Cannot start spawn helper: %s\n"), g_strerror (errno));
+        close (requests[0]); close (requests[1]);
+        return;
+    }
+
+    pid = fork ();
+
+    if (pid < 0) {
+        print_error (_("Cannot start spawn helper: %s\n"), g_strerror (errno));
+        close (requests[0]); close (requests[1]);
+        close (replies[0]); close (replies[1]);
+        return;
+    }
+
+    if (pid == 0) {
+        close (requests[1]);
+        close (replies[0]);
+
+        /* the commands must not keep the helper pipes open, or its death would go unnoticed */
+
+        fcntl (requests[0], F_SETFD, FD_CLOEXEC);
+        fcntl (replies[1], F_SETFD, FD_CLOEXEC);
+
+        run_spawn_helper (requests[0], replies[1]);
+        _exit (0);
+    }
+
+    close (requests[0]);
+    close (replies[1]);
+
+    /* the helper exits when the request pipe is closed, and the commands must not inherit it */
+
+    fcntl (requests[1], F_SETFD, FD_CLOEXEC);
+    fcntl (replies[0], F_SETFD, FD_CLOEXEC);
+
+    spawn_request_fd = requests[1];
+    spawn_reply_fd   = replies[0];
+
+    /* a helper that died is noticed when its request fails, not with a signal */
+
+    signal (SIGPIPE, SIG_IGN);
+
+    channel = g_io_channel_unix_new (spawn_reply_fd);
+    g_io_add_watch (channel, G_IO_IN | G_IO_ERR | G_IO_HUP, on_spawn_reply, NULL);
+    g_io_channel_unref (channel);
+}
+
+static gboolean read_spawn_pipe (gint fd, gpointer buffer, gsize size)
+{
+    gsize done = 0;
+
+    while (done < size) {
+        ssize_t ret = read (fd, (gchar *)buffer + done, size - done);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return FALSE;
+        }
+
+        done += ret;
+    }
+
+    return TRUE;
+}
+
+static void run_spawn_helper (gint request_fd, gint reply_fd)
+{
+    static gchar arguments[SPAWN_REQUEST_MAX];
+    gchar *argv[SPAWN_ARGUMENTS_MAX + 1];
+    struct spawn_request request;
+    struct spawn_reply reply;
+    posix_spawnattr_t attributes;
+    sigset_t signals;
+    pid_t pid;
+
+    /* the commands are not waited for: they are reaped by the kernel, but get the default signal handling back */
+
+    signal (SIGCHLD, SIG_IGN);
+
+    posix_spawnattr_init (&attributes);
+    posix_spawnattr_setflags (&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    sigemptyset (&signals);
+    posix_spawnattr_setsigmask (&attributes, &signals);
+
+    sigaddset (&signals, SIGCHLD);
+    sigaddset (&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault (&attributes, &signals);
+
+    while (read_spawn_pipe (request_fd, &request, sizeof (request)) == TRUE) {
+        guint argc = 0;
+        gsize i;
+
+        if (request.length == 0 || request.length > sizeof (arguments) || read_spawn_pipe (request_fd, arguments, request.length) == FALSE) {
+            break;
+        }
+
+        arguments[request.length - 1] = '\0';
+
+        for (i = 0; i < request.length && argc < SPAWN_ARGUMENTS_MAX; i += strlen (arguments + i) + 1) {
+            argv[argc++] = arguments + i;
+        }
+
+        argv[argc] = NULL;
+
+        reply.index = request.index;
+        reply.error = posix_spawnp (&pid, argv[0], NULL, &attributes, argv, environ);
+
+        if (write (reply_fd, &reply, sizeof (reply)) != sizeof (reply)) {
+            break;
+        }
+    }
+
+    posix_spawnattr_destroy (&attributes);
+}
+
+static gboolean on_spawn_reply (GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    struct spawn_reply reply;
+
+    if ((condition & G_IO_IN) == 0 || read_spawn_pipe (spawn_reply_fd, &reply, sizeof (reply)) == FALSE) {
+        /* the helper is gone, the commands are spawned from here from now on */
+
+        print_error (_("Spawn helper exited, spawning the commands directly\n"));
+
+        close (spawn_request_fd); spawn_request_fd = -1;
+        close (spawn_reply_fd); spawn_reply_fd = -1;
+
+        return FALSE;
+    }
+
+    if (reply.error != 0 && reply.index < SPAWN_COMMANDS) {
+        report_spawn_error (reply.index, g_strerror (reply.error));
+    }
+
+    return TRUE;
+}
+
+static void prepare_spawn_commands (void)
+{
+    GError *error = NULL;
+    gint index;
+
+    /* at startup and after a configuration reload, so that the parse errors show up early */
+
+    for (index = 0; index < SPAWN_COMMANDS; index++) {
+        if (prepare_spawn_command (index, &error) == FALSE) {
+            print_error (_(spawn_commands[index].error_message), error->message);
+            g_error_free (error); error = NULL;
+        }
+    }
+}
+
+static gboolean prepare_spawn_command (gint index, GError **error)
+{
+    struct spawn_command *spawn_command = &spawn_commands[index];
+    const gchar *command = *spawn_command->command;
+    struct spawn_request request;
+    gsize length = 0;
+    gint i;
+
+    if (command == NULL || (spawn_command->parsed_command != NULL && g_strcmp0 (command, spawn_command->parsed_command) == 0)) {
+        return TRUE;
+    }
+
+    g_free (spawn_command->parsed_command); spawn_command->parsed_command = NULL;
+    g_strfreev (spawn_command->argv); spawn_command->argv = NULL;
+    g_free (spawn_command->request); spawn_command->request = NULL;
+    spawn_command->request_length = 0;
+
+    if (g_shell_parse_argv (command, NULL, &spawn_command->argv, error) == FALSE) {
+        return FALSE;
+    }
+
+    spawn_command->parsed_command = g_strdup (command);
+
+    for (i = 0; spawn_command->argv[i] != NULL; i++) {
+        length += strlen (spawn_command->argv[i]) + 1;
+    }
+
+    /* a command too long for the helper is spawned from here */
+
+    if (i > SPAWN_ARGUMENTS_MAX || sizeof (request) + length > SPAWN_REQUEST_MAX) {
+        return TRUE;
+    }
+
+    request.index  = index;
+    request.length = length;
+
+    spawn_command->request_length = sizeof (request) + length;
+    spawn_command->request        = g_malloc (spawn_command->request_length);
+
+    memcpy (spawn_command->request, &request, sizeof (request));
+    length = sizeof (request);
+
+    for (i = 0; spawn_command->argv[i] != NULL; i++) {
+        gsize argument_length = strlen (spawn_command->argv[i]) + 1;
+
+        memcpy (spawn_command->request + length, spawn_command->argv[i], argument_length);
+        length += argument_length;
+    }
+
+    return TRUE;
+}
+
+static void run_spawn_command (gint index)
+{
+    struct spawn_command *spawn_command = &spawn_commands[index];
+    GError *error = NULL;
+
+    if (*spawn_command->command == NULL) {
+        return;
+    }
+
+    /* the command may well be a poweroff, the queued messages such as its syslog line go first */
+    flush_logs ();
+
+    if (prepare_spawn_command (index, &error) == FALSE) {
+        report_spawn_error (index, error->message);
+        g_error_free (error); error = NULL;
+        return;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("spawning %s command: %s\n", spawn_request_fd >= 0 && spawn_command->request_length > 0 ? "helper" : "direct", *spawn_command->command);
+    }
+
+    /* the request is written at once, its error if any comes back in on_spawn_reply () */
+
+    if (spawn_request_fd >= 0 && spawn_command->request_length > 0) {
+        if (write (spawn_request_fd, spawn_command->request, spawn_command->request_length) == (ssize_t)spawn_command->request_length) {
+            trace_event (TRACE_EVENT_SPAWN, index, 1);
+            return;
+        }
+    }
+
+    trace_event (TRACE_EVENT_SPAWN, index, 0);
+
+    if (g_spawn_async (NULL, spawn_command->argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, &error) == FALSE) {
+        report_spawn_error (index, error->message);
+        g_error_free (error); error = NULL;
+    }
+}
+
+static void report_spawn_error (gint index, const gchar *message)
+{
+    struct spawn_command *spawn_command = &spawn_commands[index];
+
+    trace_event (TRACE_EVENT_SPAWN_ERROR, index, 0);
+    trace_syslog (spawn_command->critical == TRUE ? LOG_CRIT : LOG_ERR, _(spawn_command->error_message), message);
+
+    print_error (_(spawn_command->error_message), message);
+
+#ifdef WITH_NOTIFY
+    static struct notification spawn_notifications[SPAWN_COMMANDS];
+    NOTIFY_MESSAGE (&spawn_notifications[index], _(spawn_command->notify_summary), *spawn_command->command,
+                    spawn_command->critical == TRUE ? NOTIFY_EXPIRES_NEVER : NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
+#endif
+}
+
+/*
+ * deferred command functions
+ */
+
+enum {
+    DEFERRED_COMMAND_LOW_LEVEL = 0,
+    DEFERRED_COMMAND_CRITICAL_LEVEL
+};
+
+struct deferred_command {
+    gchar      **command;
+    gint        *level;
+    guint        delay;
+    const gchar *spawning_message;
+    const gchar *skipping_message;
+    guint        source_id;
+    gboolean     cancelled;     /* skipped when no longer discharging, until it runs */
+};
+
+static struct deferred_command deferred_commands[] = {
+    {
+        &configuration.command_low_level,
+        &configuration.low_level,
+        COMMAND_LOW_LEVEL_DELAY,
+        N_("Spawning low battery level command in 5 seconds: %s"),
+        N_("Skipping low battery level command, no longer discharging"),
+        0,
+        FALSE
+    },
+    {
+        &configuration.command_critical_level,
+        &configuration.critical_level,
+        COMMAND_CRITICAL_LEVEL_DELAY,
+        N_("Spawning critical battery level command in 30 seconds: %s"),
+        N_("Skipping critical battery level command, no longer discharging"),
+        0,
+        FALSE
+    }
+};
+
+static void schedule_deferred_command (gint index)
+{
+    struct deferred_command *deferred_command = &deferred_commands[index];
+
+    if (*deferred_command->command == NULL || deferred_command->source_id != 0) {
+        return;
+    }
+
+    trace_event (TRACE_EVENT_DEFERRED, index, 1);
+    trace_syslog (LOG_CRIT, _(deferred_command->spawning_message), *deferred_command->command);
+
+    deferred_command->cancelled = FALSE;
+    deferred_command->source_id = g_timeout_add_seconds (deferred_command->delay, run_deferred_command, deferred_command);
+}
+
+static void cancel_deferred_commands (void)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (deferred_commands); i++) {
+        if (deferred_commands[i].source_id != 0) {
+            g_source_remove (deferred_commands[i].source_id);
+            deferred_commands[i].source_id = 0;
+            deferred_commands[i].cancelled = TRUE;
+
+            trace_event (TRACE_EVENT_DEFERRED, i, 0);
+            trace_syslog (LOG_NOTICE, "%s", _(deferred_commands[i].skipping_message));
+        }
+    }
+}
+
+/*
+ * the levels stay latched until the battery gets back above them by the hysteresis, so a command
+ * skipped by a flapping ac line is scheduled again once discharging resumes at or below its level
+ */
+
+static void reschedule_cancelled_commands (gint percentage)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (deferred_commands); i++) {
+        if (deferred_commands[i].cancelled == TRUE && percentage <= *deferred_commands[i].level) {
+            schedule_deferred_command (i);
+        }
+    }
+}
+
+static gboolean run_deferred_command (gpointer data)
+{
+    struct deferred_command *deferred_command = data;
+    struct battery_info info;
+
+    deferred_command->source_id = 0;
+
+    /* the battery may have been plugged in while we were waiting, check it again */
+
+    if (read_battery_info (&info) == TRUE) {
+        if (info.status != DISCHARGING && info.status != NOTCHARGING) {
+            deferred_command->cancelled = TRUE;
+
+            trace_event (TRACE_EVENT_DEFERRED, deferred_command - deferred_commands, 0);
+            trace_syslog (LOG_NOTICE, "%s", _(deferred_command->skipping_message));
+            return FALSE;
+        }
+    }
+
+    /* the deferred commands share their index with their spawn command */
+
+    run_spawn_command (deferred_command - deferred_commands);
+
+    return FALSE;
+}
+
+/*
+ * battery event functions
+ */
+
+static gint battery_events_fd = -1;
+
+static gboolean open_battery_events (struct icon *tray_icon)
+{
+    GIOChannel *channel;
+
+    battery_events_fd = battery_backend->open_events ();
+
+    if (battery_events_fd < 0) {
+        return FALSE;
+    }
+
+    channel = g_io_channel_unix_new (battery_events_fd);
+    g_io_add_watch (channel, G_IO_IN | G_IO_ERR | G_IO_HUP, (GIOFunc)on_battery_events, tray_icon);
+    g_io_channel_unref (channel);
+
+    return TRUE;
+}
+
+static gboolean on_battery_events (GIOChannel *source, GIOCondition condition, struct icon *tray_icon)
+{
+    struct battery_state state;
+
+    if (condition & (G_IO_ERR | G_IO_HUP)) {
+        close (battery_events_fd);
+        battery_events_fd = -1;
+
+        update_tray_icon_status (tray_icon, &state);
+        schedule_tray_icon_update (tray_icon, &state);
+
+        return FALSE;
+    }
+
+    if (battery_backend->read_events (battery_events_fd) == FALSE) {
+        return TRUE;
+    }
+
+    update_tray_icon_status (tray_icon, &state);
+    schedule_tray_icon_update (tray_icon, &state);
+
+    return TRUE;
+}
+
+/*
+ * tray icon functions
+ */
+
+static struct icon *create_tray_icons (void)
+{
+    GdkDisplay *display = gdk_display_get_default ();
+    struct icon *tray_icon_list = NULL;
+    gint screen;
+
+    /* every screen has its own system tray, _NET_SYSTEM_TRAY_S<screen> */
+
+    for (screen = gdk_display_get_n_screens (display) - 1; screen >= 0; screen--) {
+        struct icon *tray_icon = create_tray_icon (gdk_display_get_screen (display, screen));
+
+        tray_icon->next = tray_icon_list;
+        tray_icon_list  = tray_icon;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("tray icons: %d screens\n", gdk_display_get_n_screens (display));
+    }
+
+    open_battery_events (tray_icon_list);
+    update_tray_icon (tray_icon_list);
+
+    return tray_icon_list;
+}
+
+/* an icon without widgets nor rendered state yet, which the bench also replays into */
+
+static void init_tray_icon (struct icon *tray_icon)
+{
+    memset (tray_icon, 0, sizeof (*tray_icon));
+
+    tray_icon->size = DEFAULT_ICON_SIZE;
+    tray_icon->rendered.status     = -1;
+    tray_icon->rendered.percentage = -1;
+    tray_icon->rendered.time       = -1;
+    tray_icon->rendered.icon_id    = -1;
+    tray_icon->rendered.batteries  = 0;
+    tray_icon->tooltip[0]          = '\0';
+}
+
+static struct icon *create_tray_icon (GdkScreen *screen)
+{
+    struct icon* tray_icon = g_malloc (sizeof(*tray_icon));
+    init_tray_icon (tray_icon);
+    tray_icon->egg_tray_icon = egg_tray_icon_new_for_screen (screen, CBATTICON_STRING);
+
+    /* The tooltips are only set up once the system tray has docked us. */
+    g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "embedded", G_CALLBACK (on_tray_icon_embedded), tray_icon);
+
+    /* If the system tray goes away, our icon is kept and docked again
+        * in the next one, but we still don't want to be left with a
+        * dangling pointer to it if it ever gets destroyed.  */
+    g_object_add_weak_pointer (G_OBJECT(tray_icon->egg_tray_icon), (void**)&tray_icon->egg_tray_icon);
+
+    if (configuration.direct_draw == TRUE) {
+        /* The plug paints the pixbuf itself, and shows its own tooltip window on hover. */
+        gtk_widget_set_app_paintable (GTK_WIDGET (tray_icon->egg_tray_icon), TRUE);
+        /* no minimum size for a small tray, the icons are loaded at the allocated size */
+        gtk_widget_set_size_request (GTK_WIDGET (tray_icon->egg_tray_icon), 1, 1);
+        gtk_widget_add_events (GTK_WIDGET (tray_icon->egg_tray_icon), GDK_ENTER_NOTIFY_MASK | GDK_LEAVE_NOTIFY_MASK);
+        g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "expose-event", G_CALLBACK (on_tray_icon_expose), tray_icon);
+        g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "enter-notify-event", G_CALLBACK (on_tray_icon_enter), tray_icon);
+        g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "leave-notify-event", G_CALLBACK (on_tray_icon_leave), tray_icon);
+    } else {
+        tray_icon->image = gtk_image_new ();
+        g_object_add_weak_pointer (G_OBJECT(tray_icon->image), (void**)&tray_icon->image);
+
+        /* Add the image to the icon. */
+        gtk_container_add (GTK_CONTAINER(tray_icon->egg_tray_icon), tray_icon->image);
+        gtk_widget_show (tray_icon->image);
+    }
+
+    /* Scale the icons to the size given by the system tray. */
+    load_tray_icons (tray_icon);
+    profile_phase (PROFILE_PHASE_ICON_LOAD);
+    g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "size-allocate", G_CALLBACK (on_tray_icon_size_allocate), tray_icon);
+
+    /* Handle clicking events. */
+    gtk_widget_add_events (GTK_WIDGET (tray_icon->egg_tray_icon), GDK_BUTTON_PRESS_MASK);
+    g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "button_press_event", G_CALLBACK (on_tray_icon_click), NULL);
+
+    gtk_widget_show(GTK_WIDGET (tray_icon->egg_tray_icon));
+
+    return tray_icon;
+}
+
+/*
+ * number of tooltip and icon updates skipped because nothing changed since the last one
+ */
+
+enum {
+    SUPPRESSED_ICON = 0,
+    SUPPRESSED_TOOLTIP,
+    SUPPRESSED_TOOLTIP_TEXT
+};
+
+static const gchar *suppressed_update_names[] = { "icon", "tooltip", "tooltip text" };
+
+static guint suppressed_updates = 0;
+static guint suppressed_run     = 0;    /* since the last change, a single trace event for a whole run */
+
+static void trace_suppressed_updates (void)
+{
+    if (suppressed_run > 0) {
+        trace_event (TRACE_EVENT_SUPPRESSED, 0, suppressed_run);
+        suppressed_run = 0;
+    }
+}
+
+static void suppress_update (gint what)
+{
+    suppressed_updates++;
+    suppressed_run++;
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("%s unchanged, %u updates suppressed\n", suppressed_update_names[what], suppressed_updates);
     }
+}
 
-    return 1;
+static void load_tray_icons (struct icon *tray_icon)
+{
+    static const gint states[ICON_STATES] = { DISCHARGING, CHARGING, CHARGED, MISSING };
+    gint size = tray_icon->size;
+    gint icon_state, level;
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("icon size: %d\n", size);
+    }
+
+    /* the rendered icons are drawn on demand, at the size of the tray icon */
+
+    if (ICON_TYPE == BATTERY_ICON_RENDERED) {
+        for (icon_state = 0; icon_state < ICON_IDS; icon_state++) {
+            if (tray_icon->icons[icon_state] != NULL) {
+                g_object_unref (tray_icon->icons[icon_state]);
+                tray_icon->icons[icon_state] = NULL;
+            }
+        }
+
+        return;
+    }
+
+    for (icon_state = 0; icon_state < ICON_STATES; icon_state++) {
+        for (level = 0; level < ICON_LEVELS; level++) {
+            /* a charged battery is full whatever the level says */
+            gint percentage = states[icon_state] == CHARGED ? 100 : (level + 1) * 20;
+            gchar *name = get_icon_name (states[icon_state], percentage);
+            GError *error = NULL;
+
+            GdkPixbuf **pixbuf = &tray_icon->icons[ICON_ID (icon_state, level)];
+
+            if (*pixbuf != NULL) {
+                g_object_unref (*pixbuf);
+            }
+
+            *pixbuf = get_cached_icon (name, size, &error);
+
+            if (*pixbuf == NULL) {
+                print_error (_("Cannot load icon \"%s\": %s\n"), name, error->message);
+                g_error_free (error); error = NULL;
+            }
+        }
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("icons cache: %u hits, %u misses, %u evictions\n", icons_cache_hits, icons_cache_misses, icons_cache_evictions);
+    }
 }
 
-static void print_usage ()
+static void reload_tray_icons (struct icon *tray_icon)
 {
-    g_printf("Usage:\n"
-             "  cbatticon [OPTION...]\n"
-             "\n"
-             "Help Options:\n"
-             "  -h, --help                       Show help options\n"
-             "\n"
-             "Application Options:\n"
-             "  -v, --version                    Display the version\n"
-             "  -d, --debug                      Display debug information\n"
-             "  -u, --update-interval            Set update interval (in seconds)\n"
-             "  -i, --icon-type                  Set icon type ('standard', 'notification' or 'gpm')\n"
-             "  -l, --low-level                  Set low battery level (in percent)\n"
-             "  -r, --critical-level             Set critical battery level (in percent)\n"
-             "  -o, --command-low-level          Command to execute when low battery level is reached\n"
-             "  -c, --command-critical-level     Command to execute when critical battery level is reached\n"
-             "  -x, --command-left-click         Command to execute when left clicking on tray icon\n"
-#ifdef WITH_NOTIFY
-             "  -n, --hide-notification          Hide the notification popups\n"
-#endif
-             "  -t, --list-icon-types            List available icon types\n");
+    gint icon_id = tray_icon->rendered.icon_id;
+
+    load_tray_icons (tray_icon);
+
+    if (icon_id >= 0) {
+        tray_icon->rendered.icon_id = -1;
+        set_tray_icon (tray_icon, icon_id);
+    }
 }
 
-/*
- * sysfs functions
- */
+static void on_tray_icon_size_allocate (GtkWidget *widget, GtkAllocation *allocation, struct icon *tray_icon)
+{
+    gint size = MIN (allocation->width, allocation->height);
+    gint old_size;
+
+    if (size <= 0 || size == tray_icon->size) {
+        return;
+    }
 
-static gboolean get_battery_status (apm_info *info, gint *status)
+    old_size = tray_icon->size;
+    tray_icon->size = size;
+    reload_tray_icons (tray_icon);
+
+    if (ICON_TYPE == BATTERY_ICON_RENDERED) {
+        prune_rendered_icons (old_size);
+    }
+}
+
+static void set_tray_icon (struct icon *tray_icon, gint icon_id)
 {
-    g_return_val_if_fail (status != NULL, FALSE);
-    g_return_val_if_fail (info != NULL, FALSE);
+    gint64 start;
 
-    switch (info->battery_status) {
-#if 0
-        case 0x00: /* High */
-            *status = DISCHARGING;
-            break;
-        case 0x01: /* Low */
-            *status = LOW_LEVEL;
-            break;
-        case 0x02: /* Critical */
-            *status = CRITICAL_LEVEL;
-            break;
-#endif
-        case 0x00: /* High */
-        case 0x01: /* Low */
-        case 0x02: /* Critical */
-            *status = DISCHARGING;
-            break;
-        case 0x03: /* Charging */
-            if (info->battery_percentage == 100) {
-                *status = CHARGED;
-            } else {
-                *status = CHARGING;
-            }
-            break;
-        case 0x04: /* Selected battery not present */
-            *status = MISSING;
-            break;
-        default:
-            *status = UNKNOWN;
-            break;
+    if (tray_icon == NULL) {
+        return;
     }
 
-    if (info->battery_flags & (1 << 3) || info->ac_line_status == 0x01) {
-        if (info->battery_percentage == 100) {
-            *status = CHARGED;
-        } else {
-            *status = CHARGING;
+    if (icon_id == tray_icon->rendered.icon_id) {
+        suppress_update (SUPPRESSED_ICON);
+        return;
+    }
+
+    tray_icon->rendered.icon_id = icon_id;
+    trace_suppressed_updates ();
+
+    start = PROFILE_NOW ();
+    if (configuration.direct_draw == TRUE) {
+        /* no size negotiation, the next expose paints the new pixbuf */
+        if (tray_icon->egg_tray_icon != NULL) {
+            gtk_widget_queue_draw (GTK_WIDGET (tray_icon->egg_tray_icon));
         }
+    } else {
+        gtk_image_set_from_pixbuf (GTK_IMAGE(tray_icon->image), get_tray_icon_pixbuf (tray_icon, icon_id));
     }
+    profile_tick (PROFILE_TICK_ICON, start);
+}
 
-    return TRUE;
+static GdkPixbuf *get_tray_icon_pixbuf (struct icon *tray_icon, gint icon_id)
+{
+    if (icon_id < 0) {
+        return NULL;
+    }
+
+    /* a constant test in a build with another fixed icon type, the rendered icons are then left out */
+
+    if (ICON_TYPE == BATTERY_ICON_RENDERED && icon_id >= ICON_IDS) {
+        return get_rendered_icon (icon_id - ICON_IDS, tray_icon->size);
+    }
+
+    return tray_icon->icons[icon_id];
 }
 
 /*
- * computation functions
+ * direct draw functions: the plug has no child widget, it paints the current pixbuf
+ * from the icons cache on expose, and its tooltip window is only created on the first hover
  */
 
-static gboolean get_battery_charge (apm_info *info, gboolean remaining, gint *percentage, gint *time)
+static gboolean on_tray_icon_expose (GtkWidget *widget, GdkEventExpose *event, struct icon *tray_icon)
 {
-    g_return_val_if_fail (percentage != NULL, FALSE);
-
-    *percentage = info->battery_percentage;
+    GdkPixbuf *pixbuf = get_tray_icon_pixbuf (tray_icon, tray_icon->rendered.icon_id);
+    gint width, height;
 
-    if (time == NULL) {
+    if (pixbuf == NULL) {
         return TRUE;
     }
 
-    if (remaining == FALSE) {
-        return get_battery_time_estimation (info->battery_percentage, 100, time);
+    width  = gdk_pixbuf_get_width (pixbuf);
+    height = gdk_pixbuf_get_height (pixbuf);
+
+    gdk_draw_pixbuf (widget->window, NULL, pixbuf, 0, 0,
+                     (widget->allocation.width - width) / 2, (widget->allocation.height - height) / 2,
+                     width, height, GDK_RGB_DITHER_NONE, 0, 0);
+
+    return TRUE;
+}
+
+static gboolean on_tray_icon_enter (GtkWidget *widget, GdkEventCrossing *event, struct icon *tray_icon)
+{
+    if (tray_icon->tooltip_source_id == 0) {
+        tray_icon->tooltip_source_id = g_timeout_add (TOOLTIP_DELAY, (GSourceFunc)on_tooltip_timeout, tray_icon);
+    }
+
+    return FALSE;
+}
+
+static gboolean on_tray_icon_leave (GtkWidget *widget, GdkEventCrossing *event, struct icon *tray_icon)
+{
+    if (tray_icon->tooltip_source_id != 0) {
+        g_source_remove (tray_icon->tooltip_source_id);
+        tray_icon->tooltip_source_id = 0;
+    }
+
+    if (tray_icon->tooltip_window != NULL) {
+        gtk_widget_hide (tray_icon->tooltip_window);
+    }
+
+    return FALSE;
+}
+
+static gboolean on_tooltip_timeout (struct icon *tray_icon)
+{
+    tray_icon->tooltip_source_id = 0;
+
+    show_tooltip_window (tray_icon);
+
+    return FALSE;
+}
+
+static void show_tooltip_window (struct icon *tray_icon)
+{
+    GtkWidget *widget = GTK_WIDGET (tray_icon->egg_tray_icon);
+    GdkScreen *screen;
+    GtkRequisition requisition;
+    gint x, y;
+
+    if (widget == NULL || widget->window == NULL) {
+        return;
+    }
+
+    screen = gtk_widget_get_screen (widget);
+
+    if (tray_icon->tooltip_window == NULL) {
+        /* named as the windows of GtkTooltips, to be styled by the theme as they are */
+        tray_icon->tooltip_window = gtk_window_new (GTK_WINDOW_POPUP);
+        gtk_widget_set_name (tray_icon->tooltip_window, "gtk-tooltips");
+        gtk_window_set_screen (GTK_WINDOW (tray_icon->tooltip_window), screen);
+        gtk_window_set_resizable (GTK_WINDOW (tray_icon->tooltip_window), FALSE);
+        gtk_container_set_border_width (GTK_CONTAINER (tray_icon->tooltip_window), 4);
+
+        tray_icon->tooltip_label = gtk_label_new (NULL);
+        gtk_container_add (GTK_CONTAINER (tray_icon->tooltip_window), tray_icon->tooltip_label);
+        gtk_widget_show (tray_icon->tooltip_label);
+
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("tooltip window created\n");
+        }
     }
 
-    if (info->using_minutes) {
-        *time = info->battery_time;
+    gtk_label_set_text (GTK_LABEL (tray_icon->tooltip_label), tray_icon->tooltip[0] != '\0' ? tray_icon->tooltip : CBATTICON_STRING);
+
+    /* below the icon, or above it for a tray at the bottom of the screen */
+
+    gtk_widget_size_request (tray_icon->tooltip_window, &requisition);
+    gdk_window_get_origin (widget->window, &x, &y);
+
+    x = CLAMP (x + (widget->allocation.width - requisition.width) / 2, 0, MAX (gdk_screen_get_width (screen) - requisition.width, 0));
+
+    if (y + widget->allocation.height + requisition.height > gdk_screen_get_height (screen)) {
+        y -= requisition.height;
     } else {
-        *time = (info->battery_time + 30) / 60;
+        y += widget->allocation.height;
     }
 
-    return TRUE;
+    gtk_window_move (GTK_WINDOW (tray_icon->tooltip_window), x, y);
+    gtk_widget_show (tray_icon->tooltip_window);
+}
+
+static gboolean update_tray_icon (struct icon *tray_icon)
+{
+    struct battery_state state;
+
+    /* tray_icon is NULL in headless mode */
+
+    update_tray_icon_status (tray_icon, &state);
+
+    return schedule_tray_icon_update (tray_icon, &state);
 }
 
-static gboolean get_battery_time_estimation (gdouble remaining_capacity, gdouble y, gint *time)
+static gboolean schedule_tray_icon_update (struct icon *tray_icon, const struct battery_state *state)
 {
-    if (estimation_remaining_capacity == -1) {
-        estimation_remaining_capacity = remaining_capacity;
+    static guint update_source_id       = 0;
+    static gint  update_source_interval = 0;
+
+    gint interval = get_update_interval (state);
+
+    schedule_threshold_update (tray_icon, state);
+
+    if (update_source_id != 0 && interval == update_source_interval) {
+        return TRUE;
+    }
+
+    if (update_source_id != 0) {
+        g_source_remove (update_source_id);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("update interval: %d seconds\n", interval);
     }
 
+    update_source_id       = add_update_timeout (interval, tray_icon);
+    update_source_interval = interval;
+
+    return FALSE;
+}
+
+static guint add_update_timeout (gint interval, struct icon *tray_icon)
+{
+    struct itimerspec timer = { { interval, 0 }, { interval, 0 } };
+    GIOChannel *channel;
+    guint source_id;
+    gint fd;
+
     /*
-     * y = mx + b ... x = (y - b) / m
-     * solving for when y = 0 (discharging) or full_capacity (charging)
+     * the glib timeouts stop during a suspend with the monotonic clock,
+     * a boottime timer that expired meanwhile fires as soon as we resume, for the tray to be up to date at once
      */
 
-    if (remaining_capacity != estimation_remaining_capacity) {
-        gdouble estimation_elapsed = g_timer_elapsed (estimation_timer, NULL);
-        gdouble estimation_current_rate = (remaining_capacity - estimation_remaining_capacity) / estimation_elapsed;
-        gdouble estimation_seconds = (y - remaining_capacity) / estimation_current_rate;
+    fd = timerfd_create (CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
 
-        *time = (gint)(estimation_seconds / 60.0);
+    if (fd < 0) {
+        /* CLOCK_BOOTTIME timers need linux 2.6.39 */
+        return g_timeout_add (interval * 1000, (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
+    }
 
-        estimation_remaining_capacity = remaining_capacity;
-        estimation_time               = *time;
-        g_timer_start (estimation_timer);
-    } else {
-        *time = estimation_time;
+    if (timerfd_settime (fd, 0, &timer, NULL) < 0) {
+        close (fd);
+        return g_timeout_add (interval * 1000, (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
+    }
+
+    channel = g_io_channel_unix_new (fd);
+    g_io_channel_set_close_on_unref (channel, TRUE);
+    source_id = g_io_add_watch (channel, G_IO_IN, (GIOFunc)on_update_timer, tray_icon);
+    g_io_channel_unref (channel);
+
+    return source_id;
+}
+
+static gboolean on_update_timer (GIOChannel *source, GIOCondition condition, struct icon *tray_icon)
+{
+    guint64 expirations = 0;
+
+    if (read (g_io_channel_unix_get_fd (source), &expirations, sizeof (expirations)) != sizeof (expirations)) {
+        return TRUE;
+    }
+
+    if (expirations > 1 && configuration.debug_output == TRUE) {
+        debug_printf ("update timer expired %" G_GUINT64_FORMAT " times, probably during a suspend\n", expirations);
+    }
+
+    return update_tray_icon (tray_icon);
+}
+
+/*
+ * one-shot timer armed for the moment the estimator predicts the next level to be reached,
+ * the update it runs confirms the level (and notifies, and spawns its command) or arms it again
+ */
+
+static guint  threshold_source_id = 0;
+static gint64 threshold_deadline  = 0;
+
+static void schedule_threshold_update (struct icon *tray_icon, const struct battery_state *state)
+{
+    gint threshold = get_next_threshold (state);
+    gdouble seconds;
+    gint64 deadline;
+
+    if (threshold <= 0) {
+        if (threshold_source_id != 0) {
+            g_source_remove (threshold_source_id);
+            threshold_source_id = 0;
+        }
+
+        return;
+    }
+
+    /*
+     * a near-zero rate predicts the level ages away, the timer is bounded to what a timeout can hold;
+     * a prediction already due is not checked more often than the battery is ever polled
+     */
+
+    seconds  = (state->percentage - threshold) / -state->rate;
+    seconds  = CLAMP (seconds, configuration.min_update_interval, G_MAXUINT / 1000);
+    deadline = g_get_monotonic_time () + (gint64)(seconds * G_USEC_PER_SEC);
+
+    /* the prediction moves a little with each sample, the timer is only moved when it drifts */
+
+    if (threshold_source_id != 0 && ABS (deadline - threshold_deadline) < THRESHOLD_TIMER_SLACK * G_USEC_PER_SEC) {
+        return;
+    }
+
+    if (threshold_source_id != 0) {
+        g_source_remove (threshold_source_id);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("level %d%% predicted in %.0f seconds\n", threshold, seconds);
+    }
+
+    threshold_source_id = g_timeout_add ((guint)(seconds * 1000), (GSourceFunc)on_threshold_timeout, tray_icon);
+    threshold_deadline  = deadline;
+}
+
+static gboolean on_threshold_timeout (struct icon *tray_icon)
+{
+    threshold_source_id = 0;
+
+    update_tray_icon (tray_icon);
+
+    return FALSE;
+}
+
+static gint get_next_threshold (const struct battery_state *state)
+{
+    /* 0 when there is no level left to reach, or no discharge rate to predict it from */
+
+    if ((state->status != DISCHARGING && state->status != NOTCHARGING) || state->rate >= 0) {
+        return 0;
+    }
+
+    if (state->percentage > configuration.low_level) {
+        return configuration.low_level;
+    }
+
+    if (state->percentage > configuration.critical_level) {
+        return configuration.critical_level;
+    }
+
+    return 0;
+}
+
+static gint get_update_interval (const struct battery_state *state)
+{
+    gdouble interval = configuration.update_interval;
+    gint threshold;
+
+    switch (state->status) {
+        case CHARGING:
+            /* nothing to watch for, catch the next percent */
+
+            if (state->rate > 0) {
+                interval = 1 / state->rate;
+            }
+            break;
+
+        case DISCHARGING:
+        case NOTCHARGING:
+            if (state->rate < 0) {
+                threshold = get_next_threshold (state);
+
+                /* sample at least twice before the next level is reached */
+
+                interval = (state->percentage - threshold) / -state->rate / 2;
+
+                /* the threshold timer catches the level itself, only follow the percentage near it */
+
+                if (threshold > 0) {
+                    interval = MAX (interval, 1 / -state->rate);
+                }
+            }
+            break;
+
+        default:
+            /*
+             * battery events tell us when the ac line or the battery status change,
+             * only a (dis)charging battery still needs to be polled for its level
+             */
+
+            if (battery_events_fd >= 0) {
+                return configuration.fallback_interval;
+            }
+
+            return configuration.max_update_interval;
+    }
+
+    return (gint)CLAMP (interval, configuration.min_update_interval, configuration.max_update_interval);
+}
+
+static void set_tooltip_text (struct icon *tray_icon, const gchar *tip_text)
+{
+    /* the tooltip window of a direct draw icon is only updated while it is shown */
+
+    if (configuration.direct_draw == TRUE) {
+        if (tip_text != tray_icon->tooltip) {
+            g_strlcpy (tray_icon->tooltip, tip_text, STR_LTH);
+        }
+
+        if (tray_icon->tooltip_window != NULL && gtk_widget_get_mapped (tray_icon->tooltip_window) == TRUE) {
+            gtk_label_set_text (GTK_LABEL (tray_icon->tooltip_label), tray_icon->tooltip);
+        }
+
+        return;
+    }
+
+    /* not docked yet, on_tray_icon_embedded () will pick up the rendered state */
+
+    if (tray_icon->tooltips == NULL) {
+        return;
     }
 
-    return TRUE;
+    gtk_tooltips_set_tip (GTK_TOOLTIPS (tray_icon->tooltips), GTK_WIDGET (tray_icon->egg_tray_icon), tip_text, "");
 }
 
-static void reset_battery_time_estimation (void)
+static void on_tray_icon_embedded (GtkPlug *plug, struct icon *tray_icon)
 {
-    estimation_remaining_capacity = -1;
-    estimation_time               = -1;
-    g_timer_start (estimation_timer);
-}
+    profile_phase (PROFILE_PHASE_FIRST_DOCK);
 
-/*
- * tray icon functions
- */
+    if (configuration.direct_draw == TRUE || tray_icon->tooltips != NULL) {
+        return;
+    }
 
-static void create_tray_icon (void)
-{
-    struct icon* tray_icon = g_malloc (sizeof(*tray_icon));
-    tray_icon->egg_tray_icon = egg_tray_icon_new (CBATTICON_STRING);
-    tray_icon->image = gtk_image_new ();
     tray_icon->tooltips = gtk_tooltips_new ();
-    tray_icon->name = g_strdup ("");
-    tray_icon->size = 24;
 
-    gtk_tooltips_set_tip (GTK_TOOLTIPS (tray_icon->tooltips), GTK_WIDGET (tray_icon->egg_tray_icon), CBATTICON_STRING, "");
-
-    /* If the system tray goes away, our icon will get destroyed,
-        * and we don't want to be left with a dangling pointer to it
-        * if that happens.  */
-    g_object_add_weak_pointer (G_OBJECT(tray_icon->egg_tray_icon), (void**)&tray_icon->egg_tray_icon);
-    g_object_add_weak_pointer (G_OBJECT(tray_icon->image), (void**)&tray_icon->image);
-
-    /* Add the image to the icon. */
-    gtk_container_add (GTK_CONTAINER(tray_icon->egg_tray_icon), tray_icon->image);
-    gtk_widget_show (tray_icon->image);
+    if (tray_icon->tooltip[0] == '\0') {
+        set_tooltip_text (tray_icon, CBATTICON_STRING);
+    } else {
+        set_tooltip_text (tray_icon, tray_icon->tooltip);
+    }
+}
 
-    update_tray_icon (tray_icon);
-    g_timeout_add (configuration.update_interval * 1000, (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
+static gboolean is_rendered_state (const struct rendered_state *rendered, const struct battery_info *info, gint state, gint percentage, gint time)
+{
+    guint i;
 
-    /* Handle clicking events. */
-    gtk_widget_add_events (GTK_WIDGET (tray_icon->egg_tray_icon), GDK_BUTTON_PRESS_MASK);
-    g_signal_connect (G_OBJECT (tray_icon->egg_tray_icon), "button_press_event", G_CALLBACK (on_tray_icon_click), NULL);
+    if (rendered->status != state || rendered->percentage != percentage || rendered->time != time || rendered->batteries != info->batteries) {
+        return FALSE;
+    }
 
-    gtk_widget_show(GTK_WIDGET (tray_icon->egg_tray_icon));
-}
+    for (i = 0; i < info->batteries; i++) {
+        if (rendered->battery_status[i] != info->battery_status[i] || rendered->battery_percentage[i] != info->battery_percentage[i]) {
+            return FALSE;
+        }
+    }
 
-static void hash_table_free (gpointer data)
-{
-    free (data);
+    return TRUE;
 }
 
-static void set_tray_icon (struct icon *tray_icon, const gchar *name)
+static void set_tray_icon_tooltip (struct icon *tray_icon, const struct battery_info *info, gint state, gint percentage, gint time, gchar *tip_text)
 {
-    /*gint size = gtk_status_icon_get_size (tray_icon->gtk_icon);
+    struct rendered_state *rendered;
+    gint64 start;
+    guint i;
 
-    if (size == tray_icon->size && (name == NULL || g_strcmp0 (name, tray_icon->name) == 0)) {
+    if (tray_icon == NULL) {
         return;
     }
 
-    tray_icon->size = size;*/
+    rendered = &tray_icon->rendered;
 
-    if (name != NULL)
-    {
-        g_free (tray_icon->name);
-        tray_icon->name = g_strdup (name);
+    if (is_rendered_state (rendered, info, state, percentage, time) == TRUE) {
+        suppress_update (SUPPRESSED_TOOLTIP);
+        return;
     }
 
-    if (icons_cache == NULL) {
-        icons_cache = g_hash_table_new_full (g_str_hash, g_str_equal, hash_table_free, hash_table_free);
+    rendered->status     = state;
+    rendered->percentage = percentage;
+    rendered->time       = time;
+    rendered->batteries  = info->batteries;
+
+    for (i = 0; i < info->batteries; i++) {
+        rendered->battery_status[i]     = info->battery_status[i];
+        rendered->battery_percentage[i] = info->battery_percentage[i];
     }
 
-    gpointer value = g_hash_table_lookup (icons_cache, name);
+    /* formatted once per sample, for the first tray icon that needs it */
 
-    if (value == NULL) {
-        value = gdk_pixbuf_new_from_file (get_icon_path(name), NULL);
-        g_assert (value != NULL);
-        g_hash_table_insert (icons_cache, g_strdup (name), value);
+    if (tip_text[0] == '\0') {
+        start = PROFILE_NOW ();
+        format_tooltip (tip_text, STR_LTH, rendered);
+        profile_tick (PROFILE_TICK_FORMAT, start);
     }
 
-    gtk_image_set_from_pixbuf (GTK_IMAGE(tray_icon->image), GDK_PIXBUF(value));
-}
+    /* a new state may still read the same, such as another percentage of a missing battery */
 
-static gboolean update_tray_icon (struct icon *tray_icon)
-{
-    g_return_val_if_fail (tray_icon != NULL, FALSE);
+    if (g_strcmp0 (tip_text, tray_icon->tooltip) == 0) {
+        suppress_update (SUPPRESSED_TOOLTIP_TEXT);
+        return;
+    }
 
-    update_tray_icon_status (tray_icon);
+    g_strlcpy (tray_icon->tooltip, tip_text, STR_LTH);
+    trace_suppressed_updates ();
 
-    return TRUE;
+    start = PROFILE_NOW ();
+    set_tooltip_text (tray_icon, tray_icon->tooltip);
+    profile_tick (PROFILE_TICK_TOOLTIP, start);
 }
 
-static void set_tooltip_text (struct icon *tray_icon, const gchar *tip_text)
+static void set_tray_icons (struct icon *tray_icons, const struct battery_info *info, gint state, gint percentage, gint time, gint icon_id)
 {
-    gtk_tooltips_set_tip (GTK_TOOLTIPS (tray_icon->tooltips), GTK_WIDGET (tray_icon->egg_tray_icon), tip_text, "");
+    gchar tip_text[STR_LTH] = "";
+    struct icon *tray_icon;
+
+    /* tray_icons is NULL in headless mode */
+
+    for (tray_icon = tray_icons; tray_icon != NULL; tray_icon = tray_icon->next) {
+        set_tray_icon_tooltip (tray_icon, info, state, percentage, time, tip_text);
+        set_tray_icon (tray_icon, icon_id);
+    }
 }
 
-static void update_tray_icon_status (struct icon *tray_icon)
+static void update_tray_icon_status (struct icon *tray_icon, struct battery_state *state)
 {
-    GError *error = NULL;
-
     gint battery_status            = -1;
     static gint old_battery_status = -1;
 
@@ -632,16 +4092,45 @@ static void update_tray_icon_status (struct icon *tray_icon)
     static gboolean spawn_command_low      = FALSE;
     static gboolean spawn_command_critical = FALSE;
 
-    gint percentage, time;
-    gchar *battery_string, *time_string;
+    gint percentage, time, tooltip_status;
+    gdouble rate;
 
 #ifdef WITH_NOTIFY
-    static NotifyNotification *notification = NULL;
+    static struct notification notification;
 #endif
 
-    apm_info info;
+    struct battery_info info;
+    gint64 start, suspended;
+
+    state->status     = -1;
+    state->percentage = 0;
+    state->time       = -1;
+    state->rate       = 0;
+    state->flags      = 0;
 
-    apm_read (&info);
+    start = PROFILE_NOW ();
+
+    if (read_battery_info (&info) == FALSE) {
+        return;
+    }
+
+    profile_tick (PROFILE_TICK_READ, start);
+    profile_phase (PROFILE_PHASE_FIRST_READ);
+
+    /* first read after a resume */
+
+    suspended = get_suspended_time ();
+
+    if (suspended > 0) {
+        trace_event (TRACE_EVENT_RESUME, 0, suspended / G_USEC_PER_SEC);
+        trace_syslog (LOG_NOTICE, "resumed after %" G_GINT64_FORMAT " seconds of suspend", suspended / G_USEC_PER_SEC);
+
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("resumed after %" G_GINT64_FORMAT " seconds of suspend\n", suspended / G_USEC_PER_SEC);
+        }
+
+        forget_battery_time_estimation_samples ();
+    }
 
     /* update tray icon for AC only */
 
@@ -666,24 +4155,28 @@ static void update_tray_icon_status (struct icon *tray_icon)
 
     /* update tray icon for battery */
 
-    if (get_battery_status (&info, &battery_status) == FALSE) {
-        return;
+    battery_status = info.status;
+    state->status  = battery_status;
+
+    if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
+        cancel_deferred_commands ();
     }
 
     #define HANDLE_BATTERY_STATUS(PCT,TIM,EXP,URG)                                                          \
                                                                                                             \
             percentage = PCT;                                                                               \
-                                                                                                            \
-            battery_string = get_battery_string (battery_status, percentage);                               \
-            time_string    = get_time_string (TIM);                                                         \
+            state->percentage = percentage;                                                                 \
+            state->time       = TIM;                                                                        \
                                                                                                             \
             if (old_battery_status != battery_status) {                                                     \
                 old_battery_status  = battery_status;                                                       \
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, EXP, URG);                      \
+                trace_event (TRACE_EVENT_STATUS, battery_status, percentage);                               \
+                NOTIFY_MESSAGE (&notification, get_battery_string (battery_status, percentage),             \
+                                get_time_string (TIM), EXP, URG);                                           \
             }                                                                                               \
                                                                                                             \
-            set_tooltip_text (tray_icon, get_tooltip_string (battery_string, time_string)); \
-            set_tray_icon (tray_icon, get_icon_name (battery_status, percentage));
+            set_tray_icons (tray_icon, &info, battery_status, percentage, TIM,                              \
+                            get_icon_id (battery_status, percentage));
 
     switch (battery_status) {
         case MISSING:
@@ -701,141 +4194,130 @@ static void update_tray_icon_status (struct icon *tray_icon)
         case CHARGING:
             if (old_battery_status != CHARGING) {
                 reset_battery_time_estimation ();
+
+                if (info.batteries == 1) {
+                    load_history_estimation_samples (CHARGING);
+                }
             }
 
-            if (get_battery_charge (&info, FALSE, &percentage, &time) == FALSE) {
+            if (get_battery_charge (&info, FALSE, &percentage, &time, &rate) == FALSE) {
                 return;
             }
 
+            state->rate = rate;
+
             HANDLE_BATTERY_STATUS (percentage, time, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
             break;
 
         case DISCHARGING:
         case NOTCHARGING:
-            if (get_battery_charge (&info, TRUE, &percentage, &time) == FALSE) {
+            if (old_battery_status != DISCHARGING) {
+                reset_battery_time_estimation ();
+
+                if (info.batteries == 1) {
+                    load_history_estimation_samples (battery_status);
+                }
+            }
+
+            if (get_battery_charge (&info, TRUE, &percentage, &time, &rate) == FALSE) {
                 return;
             }
 
-            battery_string = get_battery_string (battery_status, percentage);
-            time_string    = get_time_string (time);
+            state->percentage = percentage;
+            state->time       = time;
+            state->rate       = rate;
+
+            tooltip_status = battery_status;
 
             if (old_battery_status != DISCHARGING) {
                 old_battery_status  = DISCHARGING;
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+                trace_event (TRACE_EVENT_STATUS, battery_status, percentage);
+                NOTIFY_MESSAGE (&notification, get_battery_string (battery_status, percentage), get_time_string (time), NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
 
-                battery_low            = FALSE;
-                battery_critical       = FALSE;
-                spawn_command_low      = FALSE;
-                spawn_command_critical = FALSE;
+                /*
+                 * the levels are only notified again once the battery got back above them by the hysteresis,
+                 * so that a flapping ac line does not repeat the notifications and the commands
+                 */
+
+                if (percentage > configuration.low_level + configuration.level_hysteresis) {
+                    battery_low       = FALSE;
+                    spawn_command_low = FALSE;
+                }
+
+                if (percentage > configuration.critical_level + configuration.level_hysteresis) {
+                    battery_critical       = FALSE;
+                    spawn_command_critical = FALSE;
+                }
             }
 
             if (battery_low == FALSE && percentage <= configuration.low_level) {
                 battery_low = TRUE;
+                trace_event (TRACE_EVENT_LEVEL, LOW_LEVEL, percentage);
 
-                battery_string = get_battery_string (LOW_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+                tooltip_status = LOW_LEVEL;
+                NOTIFY_MESSAGE (&notification, get_battery_string (LOW_LEVEL, percentage), get_time_string (time), NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
 
                 spawn_command_low = TRUE;
             }
 
             if (battery_critical == FALSE && percentage <= configuration.critical_level) {
                 battery_critical = TRUE;
+                trace_event (TRACE_EVENT_LEVEL, CRITICAL_LEVEL, percentage);
 
-                battery_string = get_battery_string (CRITICAL_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+                tooltip_status = CRITICAL_LEVEL;
+                NOTIFY_MESSAGE (&notification, get_battery_string (CRITICAL_LEVEL, percentage), get_time_string (time), NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
 
                 spawn_command_critical = TRUE;
             }
 
-            set_tooltip_text (tray_icon, get_tooltip_string (battery_string, time_string));
-            set_tray_icon (tray_icon, get_icon_name (battery_status, percentage));
-
-            if (spawn_command_low == TRUE) {
-                spawn_command_low = FALSE;
-
-                if (configuration.command_low_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning low battery level command in 5 seconds: %s"), configuration.command_low_level);
-                    g_usleep (G_USEC_PER_SEC * 5);
-
-                    if (get_battery_status (&info, &battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping low battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
+            if (battery_low == TRUE) {
+                state->flags |= BATTERY_STATE_LOW_LEVEL;
+            }
 
-                    if (g_spawn_command_line_async (configuration.command_low_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn low battery level command: %s\n"), error->message);
+            if (battery_critical == TRUE) {
+                state->flags |= BATTERY_STATE_CRITICAL_LEVEL;
+            }
 
-                        g_printerr (_("Cannot spawn low battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
+            set_tray_icons (tray_icon, &info, tooltip_status, percentage, time, get_icon_id (battery_status, percentage));
 
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn low battery level command!"), configuration.command_low_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
-                }
+            if (spawn_command_low == TRUE) {
+                spawn_command_low = FALSE;
+                schedule_deferred_command (DEFERRED_COMMAND_LOW_LEVEL);
             }
 
             if (spawn_command_critical == TRUE) {
                 spawn_command_critical = FALSE;
-
-                if (configuration.command_critical_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning critical battery level command in 30 seconds: %s"), configuration.command_critical_level);
-                    g_usleep (G_USEC_PER_SEC * 30);
-
-                    if (get_battery_status (&info, &battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOTCHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping critical battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
-
-                    if (g_spawn_command_line_async (configuration.command_critical_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn critical battery level command: %s\n"), error->message);
-
-                        g_printerr (_("Cannot spawn critical battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
-
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn critical battery level command!"), configuration.command_critical_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
-                }
+                schedule_deferred_command (DEFERRED_COMMAND_CRITICAL_LEVEL);
             }
+
+            reschedule_cancelled_commands (percentage);
             break;
     }
+
+    record_history_sample (&info, state);
+    publish_status (state);
 }
 
 static gboolean on_tray_icon_click (struct icon *tray_icon, GdkEventButton *event, gpointer user_data)
 {
-    GError *error = NULL;
-
     if (event->button != 1) {
         return FALSE;
     }
 
-    if (configuration.command_left_click != NULL) {
-        if (g_spawn_command_line_async (configuration.command_left_click, &error) == FALSE) {
-            syslog (LOG_ERR, _("Cannot spawn left click command: %s\n"), error->message);
-
-            g_printerr (_("Cannot spawn left click command: %s\n"), error->message);
-            g_error_free (error); error = NULL;
-
-#ifdef WITH_NOTIFY
-            static NotifyNotification *spawn_notification = NULL;
-            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn left click command!"), configuration.command_left_click, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
-#endif
-        }
-    }
+    run_spawn_command (SPAWN_COMMAND_LEFT_CLICK);
 
     return TRUE;
 }
 
 #ifdef WITH_NOTIFY
-static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency)
+/*
+ * each show is a d-bus round trip, and a popup: a message waits for the debounce window,
+ * and is dropped if a newer one comes for the same notification in the meantime
+ */
+
+static guint suppressed_notifications = 0;
+
+static void notify_message (struct notification *notification, const gchar *summary, const gchar *body, gint timeout, NotifyUrgency urgency)
 {
     g_return_if_fail (notification != NULL);
     g_return_if_fail (summary != NULL);
@@ -844,92 +4326,190 @@ static void notify_message (NotifyNotification **notification, gchar *summary, g
         return;
     }
 
-    if (*notification == NULL) {
+    if (notification->source_id != 0) {
+        g_source_remove (notification->source_id);
+        notification->source_id = 0;
+
+        suppressed_notifications++;
+
+        if (configuration.debug_output == TRUE) {
+            debug_printf ("notification \"%s\" replaced, %u notifications suppressed\n", notification->summary, suppressed_notifications);
+        }
+    }
+
+    /* the summary and the body usually come from static buffers that the next update overwrites */
+
+    g_strlcpy (notification->summary, summary, STR_LTH);
+    g_strlcpy (notification->body, body != NULL ? body : "", STR_LTH);
+    notification->has_body = body != NULL;
+    notification->timeout  = timeout;
+    notification->urgency  = urgency;
+
+    if (configuration.notification_debounce == 0) {
+        show_notification (notification);
+        return;
+    }
+
+    notification->source_id = g_timeout_add (configuration.notification_debounce, show_notification, notification);
+}
+
+static gboolean show_notification (gpointer data)
+{
+    struct notification *notification = data;
+    const gchar *body = notification->has_body == TRUE ? notification->body : NULL;
+
+    notification->source_id = 0;
+
+    /* the notifications are rare, so libnotify is only set up for the first one */
+
+    if (notify_is_initted () == FALSE && notify_init (CBATTICON_STRING) == FALSE) {
+        return FALSE;
+    }
+
+    if (notification->notification == NULL) {
 #if NOTIFY_CHECK_VERSION (0, 7, 0)
-        *notification = notify_notification_new (summary, body, NULL);
+        notification->notification = notify_notification_new (notification->summary, body, NULL);
 #else
-        *notification = notify_notification_new (summary, body, NULL, NULL);
+        notification->notification = notify_notification_new (notification->summary, body, NULL, NULL);
 #endif
     } else {
-        notify_notification_update (*notification, summary, body, NULL);
+        notify_notification_update (notification->notification, notification->summary, body, NULL);
     }
 
-    notify_notification_set_timeout (*notification, timeout);
-    notify_notification_set_urgency (*notification, urgency);
-    notify_notification_show (*notification, NULL);
+    notify_notification_set_timeout (notification->notification, notification->timeout);
+    notify_notification_set_urgency (notification->notification, notification->urgency);
+    notify_notification_show (notification->notification, NULL);
+
+    return FALSE;
 }
 #endif
 
-static gchar* get_tooltip_string (gchar *battery, gchar *time)
-{
-    static gchar tooltip_string[STR_LTH];
+/*
+ * string functions
+ *
+ * the translated templates are looked up once at startup, with the plural forms of every
+ * number of minutes and of the first hours, so that a tooltip is formatted without any
+ * lookup nor allocation, with bounded g_snprintf () calls into the caller's buffer
+ */
 
-    tooltip_string[0] = '\0';
+#define TEMPLATE_HOURS 24
 
-    g_return_val_if_fail (battery != NULL, tooltip_string);
+static struct {
+    const gchar *battery[CRITICAL_LEVEL + 1];
+    const gchar *battery_missing;                   /* of a single battery among several */
+    const gchar *battery_percentage;
+    const gchar *minutes[60];                       /* "%d minutes" */
+    const gchar *minutes_remaining[60];             /* "%d minutes remaining" */
+    const gchar *hours_remaining[TEMPLATE_HOURS];   /* "%d hours, %s remaining" */
+} templates;
 
-    g_strlcpy (tooltip_string, battery, STR_LTH);
+static void load_string_templates (void)
+{
+    gint i;
+
+    templates.battery[MISSING]        = _("Battery is missing!");
+    templates.battery[UNKNOWN]        = _("Battery status is unknown!");
+    templates.battery[CHARGED]        = _("Battery is charged!");
+    templates.battery[DISCHARGING]    = _("Battery is discharging (%i%% remaining)");
+    templates.battery[NOTCHARGING]    = _("Battery is not charging (%i%% remaining)");
+    templates.battery[LOW_LEVEL]      = _("Battery level is low! (%i%% remaining)");
+    templates.battery[CRITICAL_LEVEL] = _("Battery level is critical! (%i%% remaining)");
+    templates.battery[CHARGING]       = _("Battery is charging (%i%%)");
+
+    templates.battery_missing    = _("Battery %u is missing");
+    templates.battery_percentage = _("Battery %u: %i%%");
+
+    for (i = 0; i < 60; i++) {
+        templates.minutes[i]           = g_dngettext (NULL, "%d minute", "%d minutes", i);
+        templates.minutes_remaining[i] = g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", i);
+    }
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("tooltip: %s\n", battery);
+    for (i = 0; i < TEMPLATE_HOURS; i++) {
+        templates.hours_remaining[i] = g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", i);
     }
+}
 
-    if (time != NULL) {
-        g_strlcat (tooltip_string, "\n", STR_LTH);
-        g_strlcat (tooltip_string, time, STR_LTH);
+/* g_snprintf () returns the length it would have written */
+#define FORMATTED_LENGTH(LENGTH,SIZE) ((gsize)MIN ((gsize)MAX ((LENGTH), 0), (SIZE) - 1))
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("tooltip: %s\n", time);
-        }
+static gsize format_battery (gchar *buffer, gsize size, gint state, gint percentage)
+{
+    /* the templates without percentage just ignore it */
+
+    if (state < 0 || state > CRITICAL_LEVEL) {
+        buffer[0] = '\0';
+        return 0;
     }
 
-    return tooltip_string;
+    return FORMATTED_LENGTH (g_snprintf (buffer, size, templates.battery[state], percentage), size);
 }
 
-static gchar* get_battery_string (gint state, gint percentage)
+static gsize format_time (gchar *buffer, gsize size, gint minutes)
 {
-    static gchar battery_string[STR_LTH];
+    gchar minutes_string[STR_LTH];
+    gint hours;
 
-    switch (state) {
-        case MISSING:
-            g_strlcpy (battery_string, _("Battery is missing!"), STR_LTH);
-            break;
+    buffer[0] = '\0';
 
-        case UNKNOWN:
-            g_strlcpy (battery_string, _("Battery status is unknown!"), STR_LTH);
-            break;
+    if (minutes < 0) {
+        return 0;
+    }
 
-        case CHARGED:
-            g_strlcpy (battery_string, _("Battery is charged!"), STR_LTH);
-            break;
+    hours   = minutes / 60;
+    minutes = minutes % 60;
 
-        case DISCHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is discharging (%i%% remaining)"), percentage);
-            break;
+    if (hours == 0) {
+        return FORMATTED_LENGTH (g_snprintf (buffer, size, templates.minutes_remaining[minutes], minutes), size);
+    }
 
-        case NOTCHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is not charging (%i%% remaining)"), percentage);
-            break;
+    g_snprintf (minutes_string, STR_LTH, templates.minutes[minutes], minutes);
 
-        case LOW_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is low! (%i%% remaining)"), percentage);
-            break;
+    /* more than a day is rare enough to look it up */
 
-        case CRITICAL_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is critical! (%i%% remaining)"), percentage);
-            break;
+    return FORMATTED_LENGTH (g_snprintf (buffer, size, hours < TEMPLATE_HOURS ? templates.hours_remaining[hours] : g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", hours), hours, minutes_string), size);
+}
 
-        case CHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is charging (%i%%)"), percentage);
-            break;
+static gsize format_tooltip (gchar *buffer, gsize size, const struct rendered_state *rendered)
+{
+    gsize length = format_battery (buffer, size, rendered->status, rendered->percentage);
+    guint i;
 
-        default:
-            battery_string[0] = '\0';
-            break;
+    if (rendered->time >= 0 && length + 1 < size) {
+        buffer[length++] = '\n';
+        length += format_time (buffer + length, size - length, rendered->time);
+    }
+
+    /* the breakdown is only worth it with several batteries */
+
+    for (i = 0; rendered->batteries > 1 && i < rendered->batteries && length + 1 < size; i++) {
+        buffer[length++] = '\n';
+
+        if (rendered->battery_status[i] == MISSING) {
+            length += FORMATTED_LENGTH (g_snprintf (buffer + length, size - length, templates.battery_missing, i + 1), size - length);
+        } else {
+            length += FORMATTED_LENGTH (g_snprintf (buffer + length, size - length, templates.battery_percentage, i + 1, rendered->battery_percentage[i]), size - length);
+        }
+    }
+
+    buffer[length] = '\0';
+
+    if (configuration.debug_output == TRUE) {
+        debug_printf ("tooltip: %s\n", buffer);
     }
 
+    return length;
+}
+
+/* the notifications are rare, they get their strings from these static buffers */
+
+static gchar* get_battery_string (gint state, gint percentage)
+{
+    static gchar battery_string[STR_LTH];
+
+    format_battery (battery_string, STR_LTH, state, percentage);
+
     if (configuration.debug_output == TRUE) {
-        g_printf ("battery string: %s\n", battery_string);
+        debug_printf ("battery string: %s\n", battery_string);
     }
 
     return battery_string;
@@ -938,25 +4518,13 @@ static gchar* get_battery_string (gint state, gint percentage)
 static gchar* get_time_string (gint minutes)
 {
     static gchar time_string[STR_LTH];
-    static gchar minutes_string[STR_LTH];
-    gint hours;
 
-    if (minutes < 0) {
+    if (format_time (time_string, STR_LTH, minutes) == 0) {
         return NULL;
     }
 
-    hours   = minutes / 60;
-    minutes = minutes % 60;
-
-    if (hours > 0) {
-        g_sprintf (minutes_string, g_dngettext (NULL, "%d minute", "%d minutes", minutes), minutes);
-        g_sprintf (time_string, g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", hours), hours, minutes_string);
-    } else {
-        g_sprintf (time_string, g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", minutes), minutes);
-    }
-
     if (configuration.debug_output == TRUE) {
-        g_printf ("time string: %s\n", time_string);
+        debug_printf ("time string: %s\n", time_string);
     }
 
     return time_string;
@@ -966,22 +4534,22 @@ static gchar* get_icon_name (gint state, gint percentage)
 {
     static gchar icon_name[STR_LTH];
 
-    if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
+    if (ICON_TYPE == BATTERY_ICON_NOTIFICATION) {
         g_strlcpy (icon_name, "notification-battery", STR_LTH);
-    } else if (configuration.icon_type == BATTERY_ICON_GPM) {
+    } else if (ICON_TYPE == BATTERY_ICON_GPM) {
         g_strlcpy (icon_name, "gpm-primary", STR_LTH);
     } else {
         g_strlcpy (icon_name, "battery", STR_LTH);
     }
 
     if (state == MISSING || state == UNKNOWN) {
-        if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
+        if (ICON_TYPE == BATTERY_ICON_NOTIFICATION) {
             g_strlcat (icon_name, "-empty", STR_LTH);
         } else {
             g_strlcat (icon_name, "-missing", STR_LTH);
         }
     } else {
-        if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
+        if (ICON_TYPE == BATTERY_ICON_NOTIFICATION) {
                  if (percentage <= 20)  g_strlcat (icon_name, "-020", STR_LTH);
             else if (percentage <= 40)  g_strlcat (icon_name, "-040", STR_LTH);
             else if (percentage <= 60)  g_strlcat (icon_name, "-060", STR_LTH);
@@ -990,7 +4558,7 @@ static gchar* get_icon_name (gint state, gint percentage)
 
                  if (state == CHARGING) g_strlcat (icon_name, "-plugged", STR_LTH);
             else if (state == CHARGED)  g_strlcat (icon_name, "-plugged", STR_LTH);
-        } else if (configuration.icon_type == BATTERY_ICON_GPM) {
+        } else if (ICON_TYPE == BATTERY_ICON_GPM) {
                  if (state == CHARGED)  g_strlcat (icon_name, "-charged", STR_LTH);
             else if (percentage <= 20)  g_strlcat (icon_name, "-020", STR_LTH);
             else if (percentage <= 40)  g_strlcat (icon_name, "-040", STR_LTH);
@@ -1011,47 +4579,133 @@ static gchar* get_icon_name (gint state, gint percentage)
     }
 
     if (configuration.debug_output == TRUE) {
-        g_printf ("icon name: %s\n", icon_name);
+        debug_printf ("icon name: %s\n", icon_name);
     }
 
     return icon_name;
 }
 
+static gint get_icon_id (gint state, gint percentage)
+{
+    gint icon_state, level;
+
+    switch (state) {
+        case MISSING:
+        case UNKNOWN:
+            icon_state = ICON_STATE_MISSING;
+            break;
+
+        case CHARGING:
+            icon_state = ICON_STATE_CHARGING;
+            break;
+
+        case CHARGED:
+            icon_state = ICON_STATE_CHARGED;
+            break;
+
+        default:
+            icon_state = ICON_STATE_DISCHARGING;
+            break;
+    }
+
+    if (ICON_TYPE == BATTERY_ICON_RENDERED) {
+        /* a single frame for a charged battery, and for a missing one */
+
+        if (icon_state == ICON_STATE_CHARGED) {
+            percentage = 100;
+        } else if (icon_state == ICON_STATE_MISSING) {
+            percentage = 0;
+        }
+
+        return ICON_IDS + RENDERED_ICON_ID (icon_state, get_rendered_icon_level (state, percentage), percentage);
+    }
+
+    level = CLAMP ((percentage - 1) / 20, 0, ICON_LEVELS - 1);
+
+    return ICON_ID (icon_state, level);
+}
+
 int main (int argc, char **argv)
 {
     gint ret;
 
-    switch (apm_exists ()) {
-        case 1:
-            fprintf (stderr, "No APM support in kernel\n");
-            exit (1);
-        case 2:
-            fprintf (stderr, "Old APM support in kernel\n");
-            exit (2);
-    }
+    profile_start = g_get_monotonic_time ();
 
     setlocale (LC_ALL, "");
     bindtextdomain (CBATTICON_STRING, NLSDIR);
     bind_textdomain_codeset (CBATTICON_STRING, "UTF-8");
     textdomain (CBATTICON_STRING);
+    load_string_templates ();
 
     ret = get_options (argc, argv);
     if (ret <= 0) {
+        flush_logs ();
         return ret;
     }
 
-#ifdef WITH_NOTIFY
-    if (configuration.hide_notification == FALSE) {
-        if (notify_init (CBATTICON_STRING) == FALSE) {
-            return -1;
-        }
+    /* only with a command to run, and before gtk_init (), for the helper to stay small */
+
+    if (configuration.command_low_level != NULL || configuration.command_critical_level != NULL || configuration.command_left_click != NULL) {
+        start_spawn_helper ();
+    }
+
+    if (configuration.headless == FALSE) {
+        gtk_init (&argc, &argv); /* gtk is required as from this point */
+        profile_phase (PROFILE_PHASE_GTK_INIT);
+    }
+
+    prepare_spawn_commands ();
+
+    if (open_battery_backend (configuration.backend) == FALSE) {
+        return 1;
+    }
+
+    if (configuration.history_file != NULL) {
+        open_history (configuration.history_file);
+    }
+
+    if (configuration.status_file != NULL) {
+        open_status_export (configuration.status_file);
     }
-#endif
 
-    estimation_timer = g_timer_new ();
+    if (configuration.profile == TRUE) {
+        egg_tray_icon_set_round_trip_func (profile_round_trip);
+
+        g_unix_signal_add (SIGUSR1, on_profile_signal, NULL);
+    }
+
+    /* leaving the main loop, for the queued messages and the profile to be written at exit */
+
+    g_unix_signal_add (SIGINT, on_quit_signal, NULL);
+    g_unix_signal_add (SIGTERM, on_quit_signal, NULL);
+
+    if (configuration.config_file != NULL) {
+        g_unix_signal_add (SIGHUP, on_reload_signal, NULL);
+    }
+
+    if (configuration.trace_file != NULL) {
+        g_unix_signal_add (SIGUSR2, on_trace_signal, NULL);
+    }
+
+    if (configuration.headless == TRUE) {
+        main_loop = g_main_loop_new (NULL, FALSE);
+
+        open_battery_events (NULL);
+        update_tray_icon (NULL);
+
+        g_main_loop_run (main_loop);
+    } else {
+        tray_icons = create_tray_icons ();
+        gtk_main();
+    }
+
+    flush_logs ();
+
+    if (configuration.profile == TRUE) {
+        dump_profile ();
+    }
 
-    create_tray_icon ();
-    gtk_main();
+    close_battery_backend ();
 
     return 0;
 }
@@ -25,13 +25,30 @@
 #define SYSTEM_TRAY_REQUEST_DOCK    0
 #define SYSTEM_TRAY_BEGIN_MESSAGE   1
 #define SYSTEM_TRAY_CANCEL_MESSAGE  2
+
+/* number of request ranges whose BadWindow errors are still expected */
+#define IGNORED_REQUESTS            8
          
 static GtkPlugClass *parent_class = NULL;
 
+static EggTrayIconRoundTripFunc round_trip_func = NULL;
+
+/* the tray manager can go away at any time, which makes the requests we send
+ * to its window fail: instead of syncing with the server after each of them,
+ * their serials are remembered and their errors dropped when they come in */
+static struct {
+  unsigned long first;
+  unsigned long last;
+} ignored_requests[IGNORED_REQUESTS];
+static guint ignored_requests_head = 0;
+
+static XErrorHandler previous_error_handler = NULL;
+
 static void egg_tray_icon_init (EggTrayIcon *icon);
 static void egg_tray_icon_class_init (EggTrayIconClass *klass);
 
 static void egg_tray_icon_update_manager_window (EggTrayIcon *icon);
+static gboolean egg_tray_icon_delete_event (GtkWidget *widget, GdkEventAny *event);
 
 GType
 egg_tray_icon_get_type (void)
@@ -70,7 +87,72 @@ egg_tray_icon_init (EggTrayIcon *icon)
 static void
 egg_tray_icon_class_init (EggTrayIconClass *klass)
 {
+  GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+
   parent_class = g_type_class_peek_parent (klass);
+
+  widget_class->delete_event = egg_tray_icon_delete_event;
+}
+
+static gboolean
+egg_tray_icon_delete_event (GtkWidget *widget, GdkEventAny *event)
+{
+  EggTrayIcon *icon = EGG_TRAY_ICON (widget);
+
+  /* GtkPlug sends this when the tray manager died and left us on the root
+   * window: hide the plug instead of destroying it, so that the next tray
+   * manager docks it again with its child widgets (and their pixbufs) */
+  gtk_widget_hide (widget);
+  icon->undocked = TRUE;
+
+  /* The MANAGER message of a new tray manager may have come in before
+   * this, look for the owner again and dock into it at once if any */
+  egg_tray_icon_update_manager_window (icon);
+
+  return TRUE;
+}
+
+static int
+egg_tray_icon_error_handler (Display *display, XErrorEvent *error)
+{
+  guint i;
+
+  if (error->error_code == BadWindow)
+    {
+      for (i = 0; i < IGNORED_REQUESTS; i++)
+	{
+	  if (error->serial >= ignored_requests[i].first &&
+	      error->serial <= ignored_requests[i].last)
+	    return 0;
+	}
+    }
+
+  if (previous_error_handler == NULL)
+    return 0;
+
+  return previous_error_handler (display, error);
+}
+
+static unsigned long
+egg_tray_icon_ignore_errors_begin (Display *display)
+{
+  if (previous_error_handler == NULL)
+    previous_error_handler = XSetErrorHandler (egg_tray_icon_error_handler);
+
+  return NextRequest (display);
+}
+
+static void
+egg_tray_icon_ignore_errors_end (Display *display, unsigned long first)
+{
+  unsigned long last = NextRequest (display) - 1;
+
+  if (last < first)
+    return;
+
+  ignored_requests[ignored_requests_head].first = first;
+  ignored_requests[ignored_requests_head].last = last;
+  ignored_requests_head = (ignored_requests_head + 1) % IGNORED_REQUESTS;
 }
 
 static GdkFilterReturn
@@ -106,28 +188,26 @@ egg_tray_icon_send_manager_message (EggTrayIcon *icon,
 {
   XClientMessageEvent ev;
   Display *display;
+  unsigned long first;
   
   ev.type = ClientMessage;
   ev.window = window;
   ev.message_type = icon->system_tray_opcode_atom;
   ev.format = 32;
-  ev.data.l[0] = gdk_x11_get_server_time (GTK_WIDGET (icon)->window);
+  /* gdk_x11_get_server_time () would wait on a property change round trip */
+  ev.data.l[0] = CurrentTime;
   ev.data.l[1] = message;
   ev.data.l[2] = data1;
   ev.data.l[3] = data2;
   ev.data.l[4] = data3;
 
-#if HAVE_GTK_MULTIHEAD
   display = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (icon)));
-#else
-  display = gdk_display;
-#endif
   
-  gdk_error_trap_push ();
+  first = egg_tray_icon_ignore_errors_begin (display);
   XSendEvent (display,
 	      icon->manager_window, False, NoEventMask, (XEvent *)&ev);
-  XSync (display, False);
-  gdk_error_trap_pop ();
+  egg_tray_icon_ignore_errors_end (display, first);
+  XFlush (display);
 }
 
 static void
@@ -144,99 +224,115 @@ static void
 egg_tray_icon_update_manager_window (EggTrayIcon *icon)
 {
   Display *xdisplay;
+  unsigned long first;
+  gint64 start = 0;
   
-#if HAVE_GTK_MULTIHEAD
   xdisplay = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (icon)));
-#else
-  xdisplay = gdk_display;
-#endif
   
   if (icon->manager_window != None)
     {
       GdkWindow *gdkwin;
 
-#if HAVE_GTK_MULTIHEAD
-      gdkwin = gdk_window_lookup_for_display (display,
+      gdkwin = gdk_window_lookup_for_display (gtk_widget_get_display (GTK_WIDGET (icon)),
 					      icon->manager_window);
-#else
-      gdkwin = gdk_window_lookup (icon->manager_window);
-#endif
       
       gdk_window_remove_filter (gdkwin, egg_tray_icon_manager_filter, icon);
     }
   
-  XGrabServer (xdisplay);
-  
+  /* No server grab: if the owner dies before XSelectInput () reaches the
+   * server, the request fails with a BadWindow that is ignored, and the next
+   * tray manager announces itself with a MANAGER message anyway */
+  if (round_trip_func != NULL)
+    start = g_get_monotonic_time ();
+
   icon->manager_window = XGetSelectionOwner (xdisplay,
 					     icon->selection_atom);
 
-  if (icon->manager_window != None)
-    XSelectInput (xdisplay,
-		  icon->manager_window, StructureNotifyMask);
+  if (round_trip_func != NULL)
+    round_trip_func (g_get_monotonic_time () - start);
 
-  XUngrabServer (xdisplay);
-  XFlush (xdisplay);
+  if (icon->manager_window != None)
+    {
+      first = egg_tray_icon_ignore_errors_begin (xdisplay);
+      XSelectInput (xdisplay,
+		    icon->manager_window, StructureNotifyMask);
+      egg_tray_icon_ignore_errors_end (xdisplay, first);
+    }
   
   if (icon->manager_window != None)
     {
       GdkWindow *gdkwin;
 
-#if HAVE_GTK_MULTIHEAD
       gdkwin = gdk_window_lookup_for_display (gtk_widget_get_display (GTK_WIDGET (icon)),
 					      icon->manager_window);
-#else
-      gdkwin = gdk_window_lookup (icon->manager_window);
-#endif
       
       gdk_window_add_filter (gdkwin, egg_tray_icon_manager_filter, icon);
 
+      /* The previous tray manager went away, the plug is docked again as is */
+      if (icon->undocked)
+	{
+	  icon->undocked = FALSE;
+	  gtk_widget_show (GTK_WIDGET (icon));
+	}
+
       /* Send a request that we'd like to dock */
       egg_tray_icon_send_dock_request (icon);
     }
 }
 
 EggTrayIcon *
-egg_tray_icon_new_for_xscreen (Screen *xscreen, const char *name)
+egg_tray_icon_new_for_screen (GdkScreen *screen, const char *name)
 {
   EggTrayIcon *icon;
   char buffer[256];
+  char *atom_names[4];
+  Atom atoms[4];
+  Display *xdisplay;
   GdkWindow *root_window;
+  gint64 start = 0;
 
-  g_return_val_if_fail (xscreen != NULL, NULL);
+  g_return_val_if_fail (GDK_IS_SCREEN (screen), NULL);
   
   icon = g_object_new (EGG_TYPE_TRAY_ICON, NULL);
   gtk_window_set_title (GTK_WINDOW (icon), name);
 
-#if HAVE_GTK_MULTIHEAD
   gtk_plug_construct_for_display (GTK_PLUG (icon),
 				  gdk_screen_get_display (screen), 0);
-#else
-  gtk_plug_construct (GTK_PLUG (icon), 0);
-#endif
+
+  /* The plug has to live on the root window of the screen it docks into */
+  gtk_window_set_screen (GTK_WINDOW (icon), screen);
   
   gtk_widget_realize (GTK_WIDGET (icon));
 
+  xdisplay = GDK_DISPLAY_XDISPLAY (gdk_screen_get_display (screen));
+
   /* Now see if there's a manager window around */
   g_snprintf (buffer, sizeof (buffer),
 	      "_NET_SYSTEM_TRAY_S%d",
-	      XScreenNumberOfScreen (xscreen));
-  
-  icon->selection_atom = XInternAtom (DisplayOfScreen (xscreen),
-				      buffer, False);
-  
-  icon->manager_atom = XInternAtom (DisplayOfScreen (xscreen),
-				    "MANAGER", False);
-  
-  icon->system_tray_opcode_atom = XInternAtom (DisplayOfScreen (xscreen),
-					       "_NET_SYSTEM_TRAY_OPCODE", False);
+	      gdk_screen_get_number (screen));
+
+  /* All the atoms in a single round trip */
+  atom_names[0] = buffer;
+  atom_names[1] = "MANAGER";
+  atom_names[2] = "_NET_SYSTEM_TRAY_OPCODE";
+  atom_names[3] = "_NET_SYSTEM_TRAY_MESSAGE_DATA";
+
+  if (round_trip_func != NULL)
+    start = g_get_monotonic_time ();
+
+  XInternAtoms (xdisplay, atom_names, 4, False, atoms);
+
+  if (round_trip_func != NULL)
+    round_trip_func (g_get_monotonic_time () - start);
+
+  icon->selection_atom = atoms[0];
+  icon->manager_atom = atoms[1];
+  icon->system_tray_opcode_atom = atoms[2];
+  icon->message_data_atom = atoms[3];
 
   egg_tray_icon_update_manager_window (icon);
 
-#if HAVE_GTK_MULTIHEAD
   root_window = gdk_screen_get_root_window (screen);
-#else
-  root_window = gdk_window_lookup (gdk_x11_get_default_root_xwindow ());
-#endif
   
   /* Add a root window filter so that we get changes on MANAGER */
   gdk_window_add_filter (root_window,
@@ -245,23 +341,10 @@ egg_tray_icon_new_for_xscreen (Screen *xscreen, const char *name)
   return icon;
 }
 
-#if HAVE_GTK_MULTIHEAD
-EggTrayIcon *
-egg_tray_icon_new_for_screen (GdkScreen *screen, const char *name)
-{
-  EggTrayIcon *icon;
-  char buffer[256];
-
-  g_return_val_if_fail (GDK_IS_SCREEN (screen), NULL);
-
-  return egg_tray_icon_new_for_xscreen (GDK_SCREEN_XSCREEN (screen), name);
-}
-#endif
-
 EggTrayIcon*
 egg_tray_icon_new (const gchar *name)
 {
-  return egg_tray_icon_new_for_xscreen (DefaultScreenOfDisplay (gdk_display), name);
+  return egg_tray_icon_new_for_screen (gdk_screen_get_default (), name);
 }
 
 guint
@@ -271,6 +354,8 @@ egg_tray_icon_send_message (EggTrayIcon *icon,
 			    gint         len)
 {
   guint stamp;
+  Display *xdisplay;
+  unsigned long first;
   
   g_return_val_if_fail (EGG_IS_TRAY_ICON (icon), 0);
   g_return_val_if_fail (timeout >= 0, 0);
@@ -289,24 +374,18 @@ egg_tray_icon_send_message (EggTrayIcon *icon,
 				      (Window)gtk_plug_get_id (GTK_PLUG (icon)),
 				      timeout, len, stamp);
 
-  /* Now to send the actual message */
-  gdk_error_trap_push ();
+  xdisplay = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (icon)));
+
+  /* Now to send the actual message, flushed once at the end */
+  first = egg_tray_icon_ignore_errors_begin (xdisplay);
   while (len > 0)
     {
       XClientMessageEvent ev;
-      Display *xdisplay;
-
-#if HAVE_GTK_MULTIHEAD
-      xdisplay = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (icon)));
-#else
-      xdisplay = gdk_display;
-#endif
       
       ev.type = ClientMessage;
       ev.window = (Window)gtk_plug_get_id (GTK_PLUG (icon));
       ev.format = 8;
-      ev.message_type = XInternAtom (xdisplay,
-				     "_NET_SYSTEM_TRAY_MESSAGE_DATA", False);
+      ev.message_type = icon->message_data_atom;
       if (len > 20)
 	{
 	  memcpy (&ev.data, message, 20);
@@ -321,9 +400,9 @@ egg_tray_icon_send_message (EggTrayIcon *icon,
 
       XSendEvent (xdisplay,
 		  icon->manager_window, False, StructureNotifyMask, (XEvent *)&ev);
-      XSync (xdisplay, False);
     }
-  gdk_error_trap_pop ();
+  egg_tray_icon_ignore_errors_end (xdisplay, first);
+  XFlush (xdisplay);
 
   return stamp;
 }
@@ -339,3 +418,9 @@ egg_tray_icon_cancel_message (EggTrayIcon *icon,
 				      (Window)gtk_plug_get_id (GTK_PLUG (icon)),
 				      id, 0, 0);
 }
+
+void
+egg_tray_icon_set_round_trip_func (EggTrayIconRoundTripFunc func)
+{
+  round_trip_func = func;
+}
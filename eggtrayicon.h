@@ -45,7 +45,11 @@ struct _EggTrayIcon
   Atom selection_atom;
   Atom manager_atom;
   Atom system_tray_opcode_atom;
+  Atom message_data_atom;
   Window manager_window;
+
+  /* hidden since its tray manager went away */
+  gboolean undocked;
 };
 
 struct _EggTrayIconClass
@@ -53,12 +57,13 @@ struct _EggTrayIconClass
   GtkPlugClass parent_class;
 };
 
+/* called with the duration of each round trip to the X server */
+typedef void (*EggTrayIconRoundTripFunc) (gint64 microseconds);
+
 GType        egg_tray_icon_get_type       (void);
 
-#if EGG_TRAY_ENABLE_MULTIHEAD
 EggTrayIcon *egg_tray_icon_new_for_screen (GdkScreen   *screen,
 					   const gchar *name);
-#endif
 
 EggTrayIcon *egg_tray_icon_new            (const gchar *name);
 
@@ -69,6 +74,8 @@ guint        egg_tray_icon_send_message   (EggTrayIcon *icon,
 void         egg_tray_icon_cancel_message (EggTrayIcon *icon,
 					   guint        id);
 
+void         egg_tray_icon_set_round_trip_func (EggTrayIconRoundTripFunc func);
+
 
 					    
 G_END_DECLS